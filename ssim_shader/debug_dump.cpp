@@ -0,0 +1,515 @@
+// debug_dump.cpp : sampled, asynchronous dumps of intermediate planes
+//
+
+#include "stdafx.h"
+#include "debug_dump.h"
+#include <compressapi.h>
+#include <vector>
+
+static CONST PCWSTR DUMP_STAGE_NAME[] = {
+    L"eye",
+    L"variance",
+    L"covariance",
+    L"mean",
+};
+
+// A CPU plane, or a GPU texture with its whole mip chain. pData holds the
+// planes back to back, each rawSize bytes.
+typedef struct _DUMP_ENTRY
+{
+    UINT32 planeCount;
+    DUMP_FILE_HEADER headers[D3D11_REQ_MIP_LEVELS];
+    PBYTE pData;
+}DUMP_ENTRY, *PDUMP_ENTRY;
+
+typedef struct _DUMP_PENDING_TEXTURE
+{
+    ID3D11Texture2D *pStagingTex;
+    UINT64 frameIndex;
+    DUMP_STAGE stage;
+    UINT32 eye;
+    UINT32 bitDepth;
+}DUMP_PENDING_TEXTURE, *PDUMP_PENDING_TEXTURE;
+
+typedef struct _DUMP_CONTEXT
+{
+    BOOL isRunning;
+    BOOL isStopping;
+    UINT32 sampleEvery;
+    WCHAR dir[MAX_PATH];
+    HANDLE hWriterThread;
+    CRITICAL_SECTION lock;
+    CONDITION_VARIABLE queueNotEmpty;
+    CONDITION_VARIABLE queueNotFull;
+    DUMP_ENTRY queue[DUMP_QUEUE_DEPTH];
+    UINT32 queueHead;
+    UINT32 queueCount;
+    volatile LONG droppedCount; // In queue entries, a GPU texture counts once
+    // Only touched by the thread owning the device context. Staging copies
+    // are created once with the GPU engine and recycled by DebugDumpPoll.
+    std::vector<DUMP_PENDING_TEXTURE> pendingTextures;
+    std::vector<ID3D11Texture2D*> stagingPool;
+    std::vector<ID3D11Texture2D*> freeStaging;
+}DUMP_CONTEXT, *PDUMP_CONTEXT;
+
+static DUMP_CONTEXT g_DumpCtx;
+
+static UINT32 GetFormatBytesPerPixel(DXGI_FORMAT format)
+{
+    switch (format)
+    {
+    case DXGI_FORMAT_R8_UNORM:
+        return 1;
+    case DXGI_FORMAT_R16_UNORM:
+        return 2;
+    case DXGI_FORMAT_R32_FLOAT:
+        return 4;
+    default:
+        return 0;
+    }
+}
+
+static HRESULT WriteDumpPlane(COMPRESSOR_HANDLE hCompressor, PBYTE pScratch, SIZE_T scratchSize, CONST DUMP_FILE_HEADER &planeHeader, CONST BYTE *pData)
+{
+    HRESULT hr = S_OK;
+    DUMP_FILE_HEADER header = planeHeader;
+    CONST BYTE *pPayload = pData;
+    SIZE_T compressedSize = 0;
+
+    header.compression = DUMP_COMPRESSION_NONE;
+    header.payloadSize = header.rawSize;
+    if (hCompressor && pScratch &&
+        Compress(hCompressor, pData, (SIZE_T)header.rawSize, pScratch, scratchSize, &compressedSize) &&
+        (compressedSize < header.rawSize))
+    {
+        header.compression = DUMP_COMPRESSION_XPRESS;
+        header.payloadSize = compressedSize;
+        pPayload = pScratch;
+    }
+
+    WCHAR path[MAX_PATH * 2];
+    swprintf_s(path, ARRAYSIZE(path), L"%s\\frame%08llu_%s_eye%u_mip%u.%s",
+        g_DumpCtx.dir, header.frameIndex, DUMP_STAGE_NAME[header.stage], header.eye, header.mipLevel, DUMP_FILE_EXTENSION);
+
+    HANDLE hFile = CreateFile(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    DWORD bytesWritten = 0;
+    if (SUCCEEDED(hr) && !WriteFile(hFile, &header, sizeof(header), &bytesWritten, NULL))
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+    }
+    if (SUCCEEDED(hr) && !WriteFile(hFile, pPayload, (DWORD)header.payloadSize, &bytesWritten, NULL))
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+    }
+    SafeCloseHandle(hFile);
+
+    return hr;
+}
+
+static DWORD WINAPI DumpWriterThread(LPVOID pParam)
+{
+    UNREFERENCED_PARAMETER(pParam);
+
+    // Compressor handles are single threaded, the writer owns its own
+    COMPRESSOR_HANDLE hCompressor = NULL;
+    if (!CreateCompressor(COMPRESS_ALGORITHM_XPRESS, NULL, &hCompressor))
+    {
+        hCompressor = NULL;
+    }
+    PBYTE pScratch = NULL;
+    SIZE_T scratchSize = 0;
+
+    for (;;)
+    {
+        DUMP_ENTRY entry = { 0 };
+
+        EnterCriticalSection(&g_DumpCtx.lock);
+        while ((g_DumpCtx.queueCount == 0) && !g_DumpCtx.isStopping)
+        {
+            SleepConditionVariableCS(&g_DumpCtx.queueNotEmpty, &g_DumpCtx.lock, INFINITE);
+        }
+        if (g_DumpCtx.queueCount == 0)
+        {
+            LeaveCriticalSection(&g_DumpCtx.lock);
+            break;
+        }
+        entry = g_DumpCtx.queue[g_DumpCtx.queueHead];
+        g_DumpCtx.queueHead = (g_DumpCtx.queueHead + 1) % DUMP_QUEUE_DEPTH;
+        g_DumpCtx.queueCount--;
+        LeaveCriticalSection(&g_DumpCtx.lock);
+        WakeConditionVariable(&g_DumpCtx.queueNotFull);
+
+        CONST BYTE *pPlane = entry.pData;
+        for (UINT32 planeIdx = 0; planeIdx < entry.planeCount; planeIdx++)
+        {
+            CONST DUMP_FILE_HEADER &header = entry.headers[planeIdx];
+            if (scratchSize < header.rawSize)
+            {
+                SafeFree(pScratch);
+                scratchSize = 0;
+                pScratch = (PBYTE)malloc((SIZE_T)header.rawSize);
+                if (pScratch)
+                {
+                    scratchSize = (SIZE_T)header.rawSize;
+                }
+            }
+            WriteDumpPlane(hCompressor, pScratch, scratchSize, header, pPlane);
+            pPlane += header.rawSize;
+        }
+        SafeFree(entry.pData);
+    }
+
+    SafeFree(pScratch);
+    if (hCompressor)
+    {
+        CloseCompressor(hCompressor);
+    }
+    return 0;
+}
+
+// Takes ownership of entry.pData. A blocking call waits for room instead of
+// dropping the entry.
+static void EnqueueDumpEntry(DUMP_ENTRY &entry, BOOL isBlocking)
+{
+    BOOL isQueued = FALSE;
+
+    EnterCriticalSection(&g_DumpCtx.lock);
+    while (isBlocking && (g_DumpCtx.queueCount == DUMP_QUEUE_DEPTH))
+    {
+        SleepConditionVariableCS(&g_DumpCtx.queueNotFull, &g_DumpCtx.lock, INFINITE);
+    }
+    if (g_DumpCtx.queueCount < DUMP_QUEUE_DEPTH)
+    {
+        UINT32 tail = (g_DumpCtx.queueHead + g_DumpCtx.queueCount) % DUMP_QUEUE_DEPTH;
+        g_DumpCtx.queue[tail] = entry;
+        g_DumpCtx.queueCount++;
+        isQueued = TRUE;
+    }
+    LeaveCriticalSection(&g_DumpCtx.lock);
+
+    if (isQueued)
+    {
+        WakeConditionVariable(&g_DumpCtx.queueNotEmpty);
+    }
+    else
+    {
+        InterlockedIncrement(&g_DumpCtx.droppedCount);
+        SafeFree(entry.pData);
+    }
+}
+
+static void InitDumpHeader(DUMP_FILE_HEADER &header, UINT64 frameIndex, DUMP_STAGE stage, UINT32 eye, UINT32 mipLevel,
+    DXGI_FORMAT format, UINT32 bitDepth, UINT32 width, UINT32 height, UINT32 pitch)
+{
+    ZeroMemory(&header, sizeof(header));
+    header.magic = DUMP_FILE_MAGIC;
+    header.version = DUMP_FILE_VERSION;
+    header.headerSize = sizeof(DUMP_FILE_HEADER);
+    header.width = width;
+    header.height = height;
+    header.pitch = pitch;
+    header.format = format;
+    header.frameIndex = frameIndex;
+    header.stage = stage;
+    header.eye = eye;
+    header.mipLevel = mipLevel;
+    header.bitDepth = bitDepth;
+    header.tileWidth = 1;
+    header.tileHeight = 1;
+    header.rawSize = (UINT64)pitch * height;
+}
+
+static void CopyDumpRows(PBYTE pDst, UINT32 rowSize, CONST BYTE *pSrc, UINT32 pitch, UINT32 height)
+{
+    for (UINT32 row = 0; row < height; row++)
+    {
+        RtlCopyMemory(pDst + (SIZE_T)row * rowSize, pSrc + (SIZE_T)row * pitch, rowSize);
+    }
+}
+
+HRESULT DebugDumpStart(CONST PWCHAR pDir, UINT32 sampleEvery)
+{
+    HRESULT hr = S_OK;
+
+    if (g_DumpCtx.isRunning || (sampleEvery == 0) || (wcslen(pDir) >= MAX_PATH))
+    {
+        hr = E_INVALIDARG;
+    }
+    if (SUCCEEDED(hr) && !CreateDirectory(pDir, NULL) && (GetLastError() != ERROR_ALREADY_EXISTS))
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        wcscpy_s(g_DumpCtx.dir, ARRAYSIZE(g_DumpCtx.dir), pDir);
+        g_DumpCtx.sampleEvery = sampleEvery;
+        g_DumpCtx.isStopping = FALSE;
+        g_DumpCtx.queueHead = 0;
+        g_DumpCtx.queueCount = 0;
+        g_DumpCtx.droppedCount = 0;
+        InitializeCriticalSection(&g_DumpCtx.lock);
+        InitializeConditionVariable(&g_DumpCtx.queueNotEmpty);
+        InitializeConditionVariable(&g_DumpCtx.queueNotFull);
+
+        g_DumpCtx.hWriterThread = CreateThread(NULL, 0, DumpWriterThread, NULL, 0, NULL);
+        if (g_DumpCtx.hWriterThread == NULL)
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            DeleteCriticalSection(&g_DumpCtx.lock);
+        }
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        // Keep compression and disk I/O out of the way of the compute threads
+        SetThreadPriority(g_DumpCtx.hWriterThread, THREAD_PRIORITY_BELOW_NORMAL);
+        g_DumpCtx.isRunning = TRUE;
+    }
+
+    return hr;
+}
+
+void DebugDumpStop()
+{
+    if (!g_DumpCtx.isRunning)
+    {
+        return;
+    }
+
+    // Normally released with the GPU engine already
+    DebugDumpReleaseStagingPool();
+
+    EnterCriticalSection(&g_DumpCtx.lock);
+    g_DumpCtx.isStopping = TRUE;
+    LeaveCriticalSection(&g_DumpCtx.lock);
+    WakeAllConditionVariable(&g_DumpCtx.queueNotEmpty);
+
+    WaitForSingleObject(g_DumpCtx.hWriterThread, INFINITE);
+    SafeCloseHandle(g_DumpCtx.hWriterThread);
+    DeleteCriticalSection(&g_DumpCtx.lock);
+    g_DumpCtx.isRunning = FALSE;
+
+    if (g_DumpCtx.droppedCount > 0)
+    {
+        printf("Debug dump: %ld dumps dropped\n", g_DumpCtx.droppedCount);
+    }
+}
+
+BOOL DebugDumpIsSampled(UINT64 frameIndex)
+{
+    return g_DumpCtx.isRunning && ((frameIndex % g_DumpCtx.sampleEvery) == 0);
+}
+
+void DebugDumpGetQueueStats(UINT32 &queueDepth, UINT64 &droppedCount)
+{
+    // Plain reads, a monitoring snapshot does not need the queue lock and
+    // may run while the dump is being stopped
+    queueDepth = *(volatile UINT32*)&g_DumpCtx.queueCount;
+    droppedCount = (UINT64)g_DumpCtx.droppedCount;
+}
+
+// Queue one CPU plane described by entry.headers[0]
+static void EnqueueDumpPlane(DUMP_ENTRY &entry, CONST BYTE *pData, UINT32 pitch)
+{
+    CONST DUMP_FILE_HEADER &header = entry.headers[0];
+    entry.pData = (PBYTE)malloc((SIZE_T)header.rawSize);
+    if (entry.pData == NULL)
+    {
+        InterlockedIncrement(&g_DumpCtx.droppedCount);
+        return;
+    }
+    CopyDumpRows(entry.pData, header.pitch, pData, pitch, header.height);
+    EnqueueDumpEntry(entry, FALSE);
+}
+
+void DebugDumpPlane(UINT64 frameIndex, DUMP_STAGE stage, UINT32 eye, UINT32 mipLevel, DXGI_FORMAT format, UINT32 bitDepth,
+    UINT32 width, UINT32 height, UINT32 bytesPerPixel, CONST BYTE *pData, UINT32 pitch)
+{
+    if (!DebugDumpIsSampled(frameIndex))
+    {
+        return;
+    }
+
+    DUMP_ENTRY entry = { 0 };
+    entry.planeCount = 1;
+    InitDumpHeader(entry.headers[0], frameIndex, stage, eye, mipLevel, format, bitDepth, width, height, width * bytesPerPixel);
+    EnqueueDumpPlane(entry, pData, pitch);
+}
+
+void DebugDumpTileGrid(UINT64 frameIndex, DUMP_STAGE stage, UINT32 eye, UINT32 bitDepth,
+    UINT32 tileWidth, UINT32 tileHeight, UINT32 columns, UINT32 rows, CONST FLOAT *pValues)
+{
+    if (!DebugDumpIsSampled(frameIndex))
+    {
+        return;
+    }
+
+    DUMP_ENTRY entry = { 0 };
+    entry.planeCount = 1;
+    UINT32 rowSize = columns * sizeof(FLOAT);
+    InitDumpHeader(entry.headers[0], frameIndex, stage, eye, 0, DXGI_FORMAT_R32_FLOAT, bitDepth, columns, rows, rowSize);
+    entry.headers[0].tileWidth = tileWidth;
+    entry.headers[0].tileHeight = tileHeight;
+    EnqueueDumpPlane(entry, (CONST BYTE*)pValues, rowSize);
+}
+
+HRESULT DebugDumpCreateStagingPool(ID3D11Texture2D *pTemplate)
+{
+    if (!g_DumpCtx.isRunning)
+    {
+        return S_OK;
+    }
+
+    HRESULT hr = S_OK;
+    ID3D11Device *pDev = NULL;
+    D3D11_TEXTURE2D_DESC desc;
+    pTemplate->GetDesc(&desc);
+    pTemplate->GetDevice(&pDev);
+
+    desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+    desc.Usage = D3D11_USAGE_STAGING;
+    desc.MiscFlags = 0;
+    desc.BindFlags = 0;
+    // Reserved up front, recycling never allocates
+    g_DumpCtx.stagingPool.reserve(DUMP_STAGING_POOL_SIZE);
+    g_DumpCtx.freeStaging.reserve(DUMP_STAGING_POOL_SIZE);
+    g_DumpCtx.pendingTextures.reserve(DUMP_STAGING_POOL_SIZE);
+    for (UINT32 idx = 0; SUCCEEDED(hr) && (idx < DUMP_STAGING_POOL_SIZE); idx++)
+    {
+        ID3D11Texture2D *pStagingTex = NULL;
+        hr = pDev->CreateTexture2D(&desc, nullptr, &pStagingTex);
+        if (SUCCEEDED(hr))
+        {
+            g_DumpCtx.stagingPool.push_back(pStagingTex);
+            g_DumpCtx.freeStaging.push_back(pStagingTex);
+        }
+    }
+    SafeRelease(pDev);
+
+    return hr;
+}
+
+void DebugDumpReleaseStagingPool()
+{
+    // Copies never polled are dropped
+    InterlockedExchangeAdd(&g_DumpCtx.droppedCount, (LONG)g_DumpCtx.pendingTextures.size());
+    g_DumpCtx.pendingTextures.clear();
+    g_DumpCtx.freeStaging.clear();
+    for (SIZE_T idx = 0; idx < g_DumpCtx.stagingPool.size(); idx++)
+    {
+        SafeRelease(g_DumpCtx.stagingPool[idx]);
+    }
+    g_DumpCtx.stagingPool.clear();
+}
+
+void DebugDumpTexture(ID3D11DeviceContext *pDevCtx, ID3D11Texture2D *pTex, UINT64 frameIndex, DUMP_STAGE stage, UINT32 eye, UINT32 bitDepth)
+{
+    if (!DebugDumpIsSampled(frameIndex))
+    {
+        return;
+    }
+
+    // Every staging copy is still waiting for the GPU or the writer
+    if (g_DumpCtx.freeStaging.empty())
+    {
+        InterlockedIncrement(&g_DumpCtx.droppedCount);
+        return;
+    }
+
+    ID3D11Texture2D *pStagingTex = g_DumpCtx.freeStaging.back();
+    g_DumpCtx.freeStaging.pop_back();
+    pDevCtx->CopyResource(pStagingTex, pTex);
+
+    DUMP_PENDING_TEXTURE pending = { pStagingTex, frameIndex, stage, eye, bitDepth };
+    g_DumpCtx.pendingTextures.push_back(pending);
+}
+
+void DebugDumpPoll(ID3D11DeviceContext *pDevCtx, BOOL waitAll)
+{
+    if (!g_DumpCtx.isRunning)
+    {
+        return;
+    }
+
+    std::vector<DUMP_PENDING_TEXTURE> &pendingTextures = g_DumpCtx.pendingTextures;
+    SIZE_T keepCount = 0;
+    for (SIZE_T idx = 0; idx < pendingTextures.size(); idx++)
+    {
+        DUMP_PENDING_TEXTURE &pending = pendingTextures[idx];
+        D3D11_TEXTURE2D_DESC desc;
+        pending.pStagingTex->GetDesc(&desc);
+
+        // Probe the first subresource, all mips come from the same copy
+        D3D11_MAPPED_SUBRESOURCE mappedResource = { 0 };
+        HRESULT hr = pDevCtx->Map(pending.pStagingTex, 0, D3D11_MAP_READ, waitAll ? 0 : D3D11_MAP_FLAG_DO_NOT_WAIT, &mappedResource);
+        if (hr == DXGI_ERROR_WAS_STILL_DRAWING)
+        {
+            pendingTextures[keepCount++] = pending;
+            continue;
+        }
+
+        // The whole mip chain goes into one queue entry, so a texture is
+        // either dumped completely or dropped as a whole
+        DUMP_ENTRY entry = { 0 };
+        UINT32 bytesPerPixel = GetFormatBytesPerPixel(desc.Format);
+        UINT64 totalSize = 0;
+        if (SUCCEEDED(hr) && ((bytesPerPixel == 0) || (desc.MipLevels > ARRAYSIZE(entry.headers))))
+        {
+            hr = E_NOTIMPL;
+            pDevCtx->Unmap(pending.pStagingTex, 0);
+        }
+        for (UINT32 mipSlice = 0; SUCCEEDED(hr) && (mipSlice < desc.MipLevels); mipSlice++)
+        {
+            UINT32 width = max(desc.Width >> mipSlice, 1U);
+            UINT32 height = max(desc.Height >> mipSlice, 1U);
+            InitDumpHeader(entry.headers[mipSlice], pending.frameIndex, pending.stage, pending.eye, mipSlice, desc.Format,
+                pending.bitDepth, width, height, width * bytesPerPixel);
+            totalSize += entry.headers[mipSlice].rawSize;
+        }
+        if (SUCCEEDED(hr))
+        {
+            entry.planeCount = desc.MipLevels;
+            entry.pData = (PBYTE)malloc((SIZE_T)totalSize);
+            if (entry.pData == NULL)
+            {
+                hr = E_OUTOFMEMORY;
+                pDevCtx->Unmap(pending.pStagingTex, 0);
+            }
+        }
+
+        PBYTE pPlane = entry.pData;
+        for (UINT32 mipSlice = 0; SUCCEEDED(hr) && (mipSlice < desc.MipLevels); mipSlice++)
+        {
+            if (mipSlice > 0)
+            {
+                hr = pDevCtx->Map(pending.pStagingTex, mipSlice, D3D11_MAP_READ, 0, &mappedResource);
+            }
+            if (SUCCEEDED(hr))
+            {
+                CONST DUMP_FILE_HEADER &header = entry.headers[mipSlice];
+                CopyDumpRows(pPlane, header.pitch, (CONST BYTE*)mappedResource.pData, mappedResource.RowPitch, header.height);
+                pDevCtx->Unmap(pending.pStagingTex, mipSlice);
+                pPlane += header.rawSize;
+            }
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            // The final flush has no compute left to protect, so it waits for room
+            EnqueueDumpEntry(entry, waitAll);
+        }
+        else
+        {
+            InterlockedIncrement(&g_DumpCtx.droppedCount);
+            SafeFree(entry.pData);
+        }
+        g_DumpCtx.freeStaging.push_back(pending.pStagingTex);
+    }
+    pendingTextures.resize(keepCount);
+}
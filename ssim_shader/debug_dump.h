@@ -0,0 +1,96 @@
+// debug_dump.h : sampled, asynchronous dumps of intermediate planes
+//
+
+#pragma once
+
+#include <d3d11.h>
+#include "ssim_common.h"
+
+#define DUMP_FILE_MAGIC     0x50445353 // 'SSDP'
+#define DUMP_FILE_VERSION   2
+#define DUMP_FILE_EXTENSION L"ssd"
+
+// Entries waiting for the writer thread, a GPU texture takes one entry for
+// its whole mip chain. When the queue is full new dumps are dropped rather
+// than blocking the caller.
+#define DUMP_QUEUE_DEPTH    16
+
+// Staging copies per GPU engine, enough for two sampled frames of
+// two eyes, two variances and the covariance. A texture sampled while all
+// of them are in flight is dropped.
+#define DUMP_STAGING_POOL_SIZE  10
+
+typedef enum _DUMP_STAGE
+{
+    DUMP_STAGE_EYE_PLANE,   // Eye luma, mips of the GPU texture hold the local means
+    DUMP_STAGE_VARIANCE,
+    DUMP_STAGE_COVARIANCE,
+    DUMP_STAGE_MEAN,        // CPU tile grid only, the GPU keeps means in the eye mips
+    DUMP_STAGE_COUNT,
+}DUMP_STAGE, *PDUMP_STAGE;
+
+typedef enum _DUMP_COMPRESSION
+{
+    DUMP_COMPRESSION_NONE,
+    DUMP_COMPRESSION_XPRESS,
+}DUMP_COMPRESSION, *PDUMP_COMPRESSION;
+
+#pragma pack(push, 1)
+// Every dump file starts with this header, followed by payloadSize bytes.
+// Uncompressed payload is height rows of pitch bytes. R32_FLOAT maps are in
+// 0-1 sample units, as the GPU targets are.
+typedef struct _DUMP_FILE_HEADER
+{
+    UINT32 magic;
+    UINT16 version;
+    UINT16 headerSize;
+    UINT32 width;
+    UINT32 height;
+    UINT32 pitch;
+    UINT32 format;          // DXGI_FORMAT of the samples
+    UINT64 frameIndex;
+    UINT32 stage;           // DUMP_STAGE
+    UINT32 eye;             // STEREO_EYE, STEREO_EYE_COUNT when not eye specific
+    UINT32 mipLevel;
+    UINT32 compression;     // DUMP_COMPRESSION
+    UINT32 bitDepth;        // Significant bits of the source samples
+    UINT32 tileWidth;       // Source samples per value of a CPU tile grid, 1 otherwise
+    UINT32 tileHeight;
+    UINT64 rawSize;
+    UINT64 payloadSize;
+}DUMP_FILE_HEADER, *PDUMP_FILE_HEADER;
+#pragma pack(pop)
+
+// Start the writer thread. Every sampleEvery-th frame is dumped into pDir.
+HRESULT DebugDumpStart(CONST PWCHAR pDir, UINT32 sampleEvery);
+
+// Flush queued dumps and stop the writer thread
+void DebugDumpStop();
+
+BOOL DebugDumpIsSampled(UINT64 frameIndex);
+
+// Entries waiting for the writer and dumps dropped so far
+void DebugDumpGetQueueStats(UINT32 &queueDepth, UINT64 &droppedCount);
+
+// Copy a CPU plane and queue it for writing
+void DebugDumpPlane(UINT64 frameIndex, DUMP_STAGE stage, UINT32 eye, UINT32 mipLevel, DXGI_FORMAT format, UINT32 bitDepth,
+    UINT32 width, UINT32 height, UINT32 bytesPerPixel, CONST BYTE *pData, UINT32 pitch);
+
+// Copy one value per tile of the CPU engine and queue it for writing
+void DebugDumpTileGrid(UINT64 frameIndex, DUMP_STAGE stage, UINT32 eye, UINT32 bitDepth,
+    UINT32 tileWidth, UINT32 tileHeight, UINT32 columns, UINT32 rows, CONST FLOAT *pValues);
+
+// Create the staging copies for textures shaped like pTemplate, once per
+// GPU engine. Does nothing when no dump is running.
+HRESULT DebugDumpCreateStagingPool(ID3D11Texture2D *pTemplate);
+
+// Release the staging copies, before the device goes away
+void DebugDumpReleaseStagingPool();
+
+// Schedule a copy of every mip of a GPU texture into a free staging copy.
+// The copy is read back by DebugDumpPoll once the GPU has finished it.
+void DebugDumpTexture(ID3D11DeviceContext *pDevCtx, ID3D11Texture2D *pTex, UINT64 frameIndex, DUMP_STAGE stage, UINT32 eye, UINT32 bitDepth);
+
+// Hand finished GPU copies to the writer thread. waitAll blocks on the rest
+// and on queue space, so the final flush loses nothing.
+void DebugDumpPoll(ID3D11DeviceContext *pDevCtx, BOOL waitAll);
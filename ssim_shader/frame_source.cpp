@@ -0,0 +1,441 @@
+// frame_source.cpp : raw .yuv and YUV4MPEG2 (.y4m) frame readers
+//
+
+#include "stdafx.h"
+#include <Shlwapi.h>
+#include <string>
+#include "frame_source.h"
+#include "metrics.h"
+
+static HRESULT ReadAt(HANDLE hFile, UINT64 offset, PVOID pBuf, DWORD size, DWORD &bytesRead)
+{
+    HRESULT hr = S_OK;
+    OVERLAPPED overlapped = { 0 };
+    overlapped.Offset = (DWORD)offset;
+    overlapped.OffsetHigh = (DWORD)(offset >> 32);
+
+    bytesRead = 0;
+    if (!ReadFile(hFile, pBuf, size, &bytesRead, &overlapped))
+    {
+        DWORD err = GetLastError();
+        if (err != ERROR_HANDLE_EOF)
+        {
+            hr = HRESULT_FROM_WIN32(err);
+        }
+    }
+
+    return hr;
+}
+
+// C tag of the stream header: 420jpeg, 420paldv, 420mpeg2, 420, 422, 444,
+// 444alpha, 411, mono, and the high bit depth forms 420p10, 444p16, mono12...
+static HRESULT ParseY4mColorspace(PCSTR pTag, CHROMA_FORMAT &chroma, UINT32 &bitDepth)
+{
+    HRESULT hr = S_OK;
+    PCSTR pDepth = NULL;
+
+    if (strncmp(pTag, "mono", 4) == 0)
+    {
+        chroma = CHROMA_FORMAT_MONO;
+        pDepth = pTag + 4;
+    }
+    else if (strcmp(pTag, "444alpha") == 0)
+    {
+        chroma = CHROMA_FORMAT_444_ALPHA;
+        pDepth = pTag + 8;
+    }
+    else if (strncmp(pTag, "420", 3) == 0)
+    {
+        chroma = CHROMA_FORMAT_420;
+        pDepth = pTag + 3;
+    }
+    else if (strncmp(pTag, "422", 3) == 0)
+    {
+        chroma = CHROMA_FORMAT_422;
+        pDepth = pTag + 3;
+    }
+    else if (strncmp(pTag, "444", 3) == 0)
+    {
+        chroma = CHROMA_FORMAT_444;
+        pDepth = pTag + 3;
+    }
+    else if (strncmp(pTag, "411", 3) == 0)
+    {
+        chroma = CHROMA_FORMAT_411;
+        pDepth = pTag + 3;
+    }
+    else
+    {
+        hr = E_INVALIDARG;
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        if (*pDepth == 'p')
+        {
+            pDepth++;
+        }
+        // jpeg, paldv, mpeg2 only describe chroma siting
+        bitDepth = ((*pDepth >= '0') && (*pDepth <= '9')) ? (UINT32)atoi(pDepth) : 8;
+        if ((bitDepth < 8) || (bitDepth > 16))
+        {
+            hr = E_INVALIDARG;
+        }
+    }
+
+    return hr;
+}
+
+static UINT64 GetChromaSampleCount(CHROMA_FORMAT chroma, UINT32 width, UINT32 height)
+{
+    UINT64 halfWidth = (width + 1) / 2;
+    switch (chroma)
+    {
+    case CHROMA_FORMAT_420:
+        return 2 * halfWidth * ((height + 1) / 2);
+    case CHROMA_FORMAT_422:
+        return 2 * halfWidth * height;
+    case CHROMA_FORMAT_444:
+        return 2 * (UINT64)width * height;
+    case CHROMA_FORMAT_444_ALPHA:
+        return 3 * (UINT64)width * height;
+    case CHROMA_FORMAT_411:
+        return 2 * (UINT64)((width + 3) / 4) * height;
+    case CHROMA_FORMAT_MONO:
+    default:
+        return 0;
+    }
+}
+
+static HRESULT ParseY4mHeader(FRAME_SOURCE &source, UINT64 &headerSize)
+{
+    HRESULT hr = S_OK;
+    CHAR header[Y4M_MAX_HEADER_SIZE + 1];
+    DWORD bytesRead = 0;
+
+    hr = ReadAt(source.hFile, 0, header, Y4M_MAX_HEADER_SIZE, bytesRead);
+
+    PCHAR pEnd = NULL;
+    if (SUCCEEDED(hr))
+    {
+        header[bytesRead] = '\0';
+        pEnd = strchr(header, '\n');
+        if ((pEnd == NULL) || (strncmp(header, Y4M_FILE_MAGIC " ", sizeof(Y4M_FILE_MAGIC)) != 0))
+        {
+            hr = E_INVALIDARG;
+        }
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        *pEnd = '\0';
+        headerSize = (UINT64)(pEnd - header) + 1;
+
+        source.chroma = CHROMA_FORMAT_420;
+        source.bitDepth = 8;
+        PCHAR pContext = NULL;
+        for (PCHAR pToken = strtok_s(header + sizeof(Y4M_FILE_MAGIC), " ", &pContext);
+            SUCCEEDED(hr) && (pToken != NULL);
+            pToken = strtok_s(NULL, " ", &pContext))
+        {
+            switch (pToken[0])
+            {
+            case 'W':
+                source.width = (UINT32)atoi(pToken + 1);
+                break;
+            case 'H':
+                source.height = (UINT32)atoi(pToken + 1);
+                break;
+            case 'F':
+                if (sscanf_s(pToken + 1, "%u:%u", &source.fpsNum, &source.fpsDen) != 2)
+                {
+                    hr = E_INVALIDARG;
+                }
+                break;
+            case 'C':
+                hr = ParseY4mColorspace(pToken + 1, source.chroma, source.bitDepth);
+                break;
+            default:
+                // Interlacing, aspect ratio and X extensions don't affect the layout
+                break;
+            }
+        }
+    }
+
+    if (SUCCEEDED(hr) && ((source.width == 0) || (source.height == 0)))
+    {
+        hr = E_INVALIDARG;
+    }
+
+    return hr;
+}
+
+static HRESULT LoadFrameIndex(CONST std::wstring &indexPath, CONST FRAME_INDEX_HEADER &expected, std::vector<UINT64> &frameOffsets)
+{
+    HRESULT hr = S_OK;
+    FRAME_INDEX_HEADER header = { 0 };
+    DWORD bytesRead = 0;
+
+    HANDLE hIndex = CreateFile(indexPath.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hIndex == INVALID_HANDLE_VALUE)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    if (SUCCEEDED(hr) && (!ReadFile(hIndex, &header, sizeof(header), &bytesRead, NULL) || (bytesRead != sizeof(header))))
+    {
+        hr = E_FAIL;
+    }
+    // A stale index is rebuilt by the caller
+    if (SUCCEEDED(hr) &&
+        ((header.magic != expected.magic) || (header.version != expected.version) ||
+         (header.fileSize != expected.fileSize) || (header.lastWriteTime != expected.lastWriteTime) ||
+         (header.frameSize != expected.frameSize) || (header.frameCount > expected.fileSize / max(expected.frameSize, 1ULL))))
+    {
+        hr = E_FAIL;
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        frameOffsets.resize((SIZE_T)header.frameCount);
+        DWORD indexSize = (DWORD)(header.frameCount * sizeof(UINT64));
+        if ((indexSize > 0) && (!ReadFile(hIndex, frameOffsets.data(), indexSize, &bytesRead, NULL) || (bytesRead != indexSize)))
+        {
+            hr = E_FAIL;
+            frameOffsets.clear();
+        }
+    }
+    SafeCloseHandle(hIndex);
+
+    return hr;
+}
+
+static HRESULT SaveFrameIndex(CONST std::wstring &indexPath, CONST FRAME_INDEX_HEADER &header, CONST std::vector<UINT64> &frameOffsets)
+{
+    HRESULT hr = S_OK;
+    DWORD bytesWritten = 0;
+    // Written aside and renamed so concurrent readers never see a partial index
+    std::wstring tempPath = indexPath + L".tmp";
+
+    HANDLE hIndex = CreateFile(tempPath.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hIndex == INVALID_HANDLE_VALUE)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    if (SUCCEEDED(hr) && !WriteFile(hIndex, &header, sizeof(header), &bytesWritten, NULL))
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+    }
+    if (SUCCEEDED(hr) && !frameOffsets.empty() &&
+        !WriteFile(hIndex, frameOffsets.data(), (DWORD)(frameOffsets.size() * sizeof(UINT64)), &bytesWritten, NULL))
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+    }
+    SafeCloseHandle(hIndex);
+
+    if (SUCCEEDED(hr) && !MoveFileEx(tempPath.c_str(), indexPath.c_str(), MOVEFILE_REPLACE_EXISTING))
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+    }
+    if (FAILED(hr))
+    {
+        DeleteFile(tempPath.c_str());
+    }
+
+    return hr;
+}
+
+// Walk the FRAME markers once. Frame headers may carry parameters, so their
+// length is only known by reading them.
+static HRESULT BuildFrameIndex(FRAME_SOURCE &source, UINT64 headerSize, UINT64 fileSize)
+{
+    HRESULT hr = S_OK;
+    CHAR frameHeader[Y4M_MAX_HEADER_SIZE + 1];
+    UINT64 pos = headerSize;
+
+    source.frameOffsets.clear();
+    while (SUCCEEDED(hr) && (pos < fileSize))
+    {
+        DWORD bytesRead = 0;
+        hr = ReadAt(source.hFile, pos, frameHeader, (DWORD)min((UINT64)Y4M_MAX_HEADER_SIZE, fileSize - pos), bytesRead);
+        if (FAILED(hr))
+        {
+            break;
+        }
+
+        frameHeader[bytesRead] = '\0';
+        PCHAR pEnd = strchr(frameHeader, '\n');
+        if ((pEnd == NULL) || (strncmp(frameHeader, Y4M_FRAME_MAGIC, sizeof(Y4M_FRAME_MAGIC) - 1) != 0))
+        {
+            hr = E_FAIL;
+            break;
+        }
+
+        UINT64 lumaOffset = pos + (UINT64)(pEnd - frameHeader) + 1;
+        if (lumaOffset + source.frameSize > fileSize)
+        {
+            // Truncated last frame
+            break;
+        }
+        source.frameOffsets.push_back(lumaOffset);
+        pos = lumaOffset + source.frameSize;
+    }
+
+    return hr;
+}
+
+BOOL IsY4mFile(CONST PWCHAR pFileName)
+{
+    return (_wcsicmp(PathFindExtension(pFileName), L".y4m") == 0) ? TRUE : FALSE;
+}
+
+HRESULT OpenFrameSource(CONST PWCHAR pFileName, UINT32 width, UINT32 height, FRAME_SOURCE &source)
+{
+    HRESULT hr = S_OK;
+    LARGE_INTEGER fileSize = { 0 };
+    FILETIME lastWriteTime = { 0 };
+    UINT64 headerSize = 0;
+
+    source.hFile = CreateFile(pFileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (source.hFile == INVALID_HANDLE_VALUE)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+    }
+    if (SUCCEEDED(hr) && (!GetFileSizeEx(source.hFile, &fileSize) || !GetFileTime(source.hFile, NULL, NULL, &lastWriteTime)))
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        source.isY4m = IsY4mFile(pFileName);
+        source.fpsNum = 0;
+        source.fpsDen = 0;
+        if (source.isY4m)
+        {
+            source.width = 0;
+            source.height = 0;
+            hr = ParseY4mHeader(source, headerSize);
+        }
+        else
+        {
+            source.width = width;
+            source.height = height;
+            source.chroma = CHROMA_FORMAT_420;
+            source.bitDepth = 8;
+            if ((width == 0) || (height == 0))
+            {
+                hr = E_INVALIDARG;
+            }
+        }
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        source.bytesPerSample = (source.bitDepth > 8) ? 2 : 1;
+        source.frameSize = ((UINT64)source.width * source.height + GetChromaSampleCount(source.chroma, source.width, source.height)) * source.bytesPerSample;
+        source.frameOffsets.clear();
+
+        if (!source.isY4m)
+        {
+            UINT64 frameCount = (UINT64)fileSize.QuadPart / source.frameSize;
+            source.frameOffsets.resize((SIZE_T)frameCount);
+            for (UINT64 frameIdx = 0; frameIdx < frameCount; frameIdx++)
+            {
+                source.frameOffsets[(SIZE_T)frameIdx] = frameIdx * source.frameSize;
+            }
+        }
+        else
+        {
+            FRAME_INDEX_HEADER indexHeader = { 0 };
+            indexHeader.magic = FRAME_INDEX_MAGIC;
+            indexHeader.version = FRAME_INDEX_VERSION;
+            indexHeader.fileSize = (UINT64)fileSize.QuadPart;
+            indexHeader.lastWriteTime = ((UINT64)lastWriteTime.dwHighDateTime << 32) | lastWriteTime.dwLowDateTime;
+            indexHeader.frameSize = source.frameSize;
+
+            std::wstring indexPath = std::wstring(pFileName) + FRAME_INDEX_EXTENSION;
+            if (FAILED(LoadFrameIndex(indexPath, indexHeader, source.frameOffsets)))
+            {
+                hr = BuildFrameIndex(source, headerSize, indexHeader.fileSize);
+                if (SUCCEEDED(hr))
+                {
+                    // Best effort, the source stays usable on a read-only share
+                    indexHeader.frameCount = source.frameOffsets.size();
+                    SaveFrameIndex(indexPath, indexHeader, source.frameOffsets);
+                }
+            }
+        }
+    }
+
+    if (FAILED(hr))
+    {
+        CloseFrameSource(source);
+    }
+
+    return hr;
+}
+
+HRESULT CloneFrameSource(CONST PWCHAR pFileName, CONST FRAME_SOURCE &opened, FRAME_SOURCE &source)
+{
+    HRESULT hr = S_OK;
+
+    source.hFile = CreateFile(pFileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (source.hFile == INVALID_HANDLE_VALUE)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        source.isY4m = opened.isY4m;
+        source.width = opened.width;
+        source.height = opened.height;
+        source.bitDepth = opened.bitDepth;
+        source.bytesPerSample = opened.bytesPerSample;
+        source.chroma = opened.chroma;
+        source.fpsNum = opened.fpsNum;
+        source.fpsDen = opened.fpsDen;
+        source.frameSize = opened.frameSize;
+        source.frameOffsets = opened.frameOffsets;
+    }
+    else
+    {
+        CloseFrameSource(source);
+    }
+
+    return hr;
+}
+
+void CloseFrameSource(FRAME_SOURCE &source)
+{
+    SafeCloseHandle(source.hFile);
+    source.frameOffsets.clear();
+}
+
+HRESULT ReadFrameLuma(FRAME_SOURCE &source, UINT64 frameIndex, PBYTE pLuma)
+{
+    HRESULT hr = S_OK;
+    DWORD lumaSize = GetLumaPitch(source) * source.height;
+    DWORD bytesRead = 0;
+
+    if (frameIndex >= GetFrameCount(source))
+    {
+        hr = E_INVALIDARG;
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = ReadAt(source.hFile, source.frameOffsets[(SIZE_T)frameIndex], pLuma, lumaSize, bytesRead);
+    }
+    if (SUCCEEDED(hr))
+    {
+        MetricsAdd(METRIC_COUNTER_BYTES_READ, bytesRead);
+    }
+    if (SUCCEEDED(hr) && (bytesRead != lumaSize))
+    {
+        hr = E_FAIL;
+    }
+
+    return hr;
+}
@@ -0,0 +1,78 @@
+// frame_source.h : raw .yuv and YUV4MPEG2 (.y4m) frame readers
+//
+
+#pragma once
+
+#include <vector>
+#include "ssim_common.h"
+
+#define Y4M_FILE_MAGIC          "YUV4MPEG2"
+#define Y4M_FRAME_MAGIC         "FRAME"
+#define Y4M_MAX_HEADER_SIZE     1024
+
+// Frame offsets of a .y4m are kept next to it as <file>.idx
+#define FRAME_INDEX_EXTENSION   L".idx"
+#define FRAME_INDEX_MAGIC       0x49344D59 // 'Y4MI'
+#define FRAME_INDEX_VERSION     1
+
+typedef enum _CHROMA_FORMAT
+{
+    CHROMA_FORMAT_420,
+    CHROMA_FORMAT_422,
+    CHROMA_FORMAT_444,
+    CHROMA_FORMAT_444_ALPHA,
+    CHROMA_FORMAT_411,
+    CHROMA_FORMAT_MONO,
+}CHROMA_FORMAT, *PCHROMA_FORMAT;
+
+typedef struct _FRAME_SOURCE
+{
+    HANDLE hFile;
+    BOOL isY4m;
+    UINT32 width;
+    UINT32 height;
+    UINT32 bitDepth;
+    UINT32 bytesPerSample;
+    CHROMA_FORMAT chroma;
+    UINT32 fpsNum;                      // 0 when the file has no header
+    UINT32 fpsDen;
+    UINT64 frameSize;                   // Sample bytes of one frame, all planes
+    std::vector<UINT64> frameOffsets;   // File offset of the luma plane of each frame
+}FRAME_SOURCE, *PFRAME_SOURCE;
+
+#pragma pack(push, 1)
+typedef struct _FRAME_INDEX_HEADER
+{
+    UINT32 magic;
+    UINT32 version;
+    UINT64 fileSize;
+    UINT64 lastWriteTime;   // FILETIME of the indexed file
+    UINT64 frameSize;
+    UINT64 frameCount;      // Followed by frameCount UINT64 offsets
+}FRAME_INDEX_HEADER, *PFRAME_INDEX_HEADER;
+#pragma pack(pop)
+
+BOOL IsY4mFile(CONST PWCHAR pFileName);
+
+// Open a frame source. Raw .yuv is 8-bit yuv420p of the given size, .y4m
+// takes everything from its stream header and ignores width/height.
+HRESULT OpenFrameSource(CONST PWCHAR pFileName, UINT32 width, UINT32 height, FRAME_SOURCE &source);
+
+// Open another handle on a source that is already open. The stream header
+// and frame index are copied, so the file is not parsed or scanned again.
+HRESULT CloneFrameSource(CONST PWCHAR pFileName, CONST FRAME_SOURCE &opened, FRAME_SOURCE &source);
+
+void CloseFrameSource(FRAME_SOURCE &source);
+
+inline UINT64 GetFrameCount(CONST FRAME_SOURCE &source)
+{
+    return source.frameOffsets.size();
+}
+
+inline UINT32 GetLumaPitch(CONST FRAME_SOURCE &source)
+{
+    return source.width * source.bytesPerSample;
+}
+
+// Read the luma plane of a frame, pLuma holds height rows of GetLumaPitch bytes
+HRESULT ReadFrameLuma(FRAME_SOURCE &source, UINT64 frameIndex, PBYTE pLuma);
@@ -0,0 +1,409 @@
+// frame_stats.cpp : CPU statistics engine, reduces a pair of planes in tiles
+//
+
+#include "stdafx.h"
+#include <math.h>
+#include <vector>
+#include "frame_stats.h"
+
+typedef struct _TILE_JOB
+{
+    CONST PLANE_VIEW *pPlaneX;
+    CONST PLANE_VIEW *pPlaneY;  // NULL when updating the history of plane X
+    UINT32 tileColumns;
+    UINT32 tileCount;
+    volatile LONG nextTile;
+    PAIR_MOMENTS *pPartials;
+    PPAIR_STATS_CACHE pCache;   // NULL computes every tile
+    BOOL isCacheUsable;         // The cached tiles belong to the previous frame
+    PPLANE_HISTORY pHistory;
+    volatile LONG tilesReused;
+}TILE_JOB, *PTILE_JOB;
+
+typedef struct _TILE_RECT
+{
+    UINT32 rowStart;
+    UINT32 rowEnd;
+    UINT32 colStart;
+    UINT32 colEnd;
+}TILE_RECT, *PTILE_RECT;
+
+HRESULT GetStereoEyeViews(CONST BYTE *pLuma, UINT32 width, UINT32 height, UINT32 pitch, UINT32 bytesPerSample, STEREO_TYPE sType, PLANE_VIEW views[STEREO_EYE_COUNT])
+{
+    HRESULT hr = S_OK;
+
+    for (UINT eyeIdx = 0; eyeIdx < STEREO_EYE_COUNT; eyeIdx++)
+    {
+        views[eyeIdx].pData = pLuma;
+        views[eyeIdx].width = width;
+        views[eyeIdx].height = height;
+        views[eyeIdx].pitch = pitch;
+        views[eyeIdx].bytesPerSample = bytesPerSample;
+    }
+
+    switch (sType)
+    {
+    case STEREO_TYPE_2D:
+        break;
+    case STEREO_TYPE_3D_SBS:
+    {
+        views[STEREO_EYE_LEFT].width = width / 2;
+        views[STEREO_EYE_RIGHT].width = width / 2;
+        views[STEREO_EYE_RIGHT].pData = pLuma + (width / 2) * bytesPerSample;
+        break;
+    }
+    case STEREO_TYPE_3D_TB:
+    {
+        views[STEREO_EYE_LEFT].height = height / 2;
+        views[STEREO_EYE_RIGHT].height = height / 2;
+        views[STEREO_EYE_RIGHT].pData = pLuma + (SIZE_T)pitch * (height / 2);
+        break;
+    }
+    default:
+        hr = E_INVALIDARG;
+        break;
+    }
+
+    if (SUCCEEDED(hr) && ((views[STEREO_EYE_LEFT].width == 0) || (views[STEREO_EYE_LEFT].height == 0)))
+    {
+        hr = E_INVALIDARG;
+    }
+
+    return hr;
+}
+
+template <class TSample> static void AccumulateTile(CONST PLANE_VIEW &planeX, CONST PLANE_VIEW &planeY, CONST TILE_RECT &tile, PAIR_MOMENTS &moments)
+{
+    UINT64 sumX = 0;
+    UINT64 sumY = 0;
+    UINT64 sumXX = 0;
+    UINT64 sumYY = 0;
+    UINT64 sumXY = 0;
+    for (UINT32 row = tile.rowStart; row < tile.rowEnd; row++)
+    {
+        CONST TSample *pX = (CONST TSample*)(planeX.pData + (SIZE_T)row * planeX.pitch);
+        CONST TSample *pY = (CONST TSample*)(planeY.pData + (SIZE_T)row * planeY.pitch);
+        for (UINT32 col = tile.colStart; col < tile.colEnd; col++)
+        {
+            UINT64 x = pX[col];
+            UINT64 y = pY[col];
+            sumX += x;
+            sumY += y;
+            sumXX += x * x;
+            sumYY += y * y;
+            sumXY += x * y;
+        }
+    }
+
+    moments.count = (UINT64)(tile.rowEnd - tile.rowStart) * (tile.colEnd - tile.colStart);
+    moments.sumX = sumX;
+    moments.sumY = sumY;
+    moments.sumXX = sumXX;
+    moments.sumYY = sumYY;
+    moments.sumXY = sumXY;
+}
+
+// Compare the tile against the previous frame and refresh the copy when it
+// differs. The previous plane is packed, pitch = width * bytesPerSample.
+static BOOL UpdatePreviousTile(CONST PLANE_VIEW &plane, PBYTE pPrevious, CONST TILE_RECT &tile)
+{
+    BOOL isUnchanged = TRUE;
+    SIZE_T previousPitch = (SIZE_T)plane.width * plane.bytesPerSample;
+    SIZE_T colOffset = (SIZE_T)tile.colStart * plane.bytesPerSample;
+    SIZE_T rowBytes = (SIZE_T)(tile.colEnd - tile.colStart) * plane.bytesPerSample;
+    for (UINT32 row = tile.rowStart; row < tile.rowEnd; row++)
+    {
+        CONST BYTE *pCurrent = plane.pData + (SIZE_T)row * plane.pitch + colOffset;
+        PBYTE pLast = pPrevious + row * previousPitch + colOffset;
+        if (!isUnchanged || (memcmp(pCurrent, pLast, rowBytes) != 0))
+        {
+            isUnchanged = FALSE;
+            memcpy(pLast, pCurrent, rowBytes);
+        }
+    }
+    return isUnchanged;
+}
+
+static void GetTileRect(CONST TILE_JOB &job, LONG tileIdx, TILE_RECT &tile)
+{
+    tile.rowStart = (tileIdx / job.tileColumns) * FRAME_STATS_TILE_HEIGHT;
+    tile.rowEnd = min(tile.rowStart + FRAME_STATS_TILE_HEIGHT, job.pPlaneX->height);
+    tile.colStart = (tileIdx % job.tileColumns) * FRAME_STATS_TILE_WIDTH;
+    tile.colEnd = min(tile.colStart + FRAME_STATS_TILE_WIDTH, job.pPlaneX->width);
+}
+
+static VOID CALLBACK HistoryWorkCallback(PTP_CALLBACK_INSTANCE pInstance, PVOID pContext, PTP_WORK pWork)
+{
+    UNREFERENCED_PARAMETER(pInstance);
+    UNREFERENCED_PARAMETER(pWork);
+
+    PTILE_JOB pJob = (PTILE_JOB)pContext;
+    PPLANE_HISTORY pHistory = pJob->pHistory;
+    for (;;)
+    {
+        LONG tileIdx = InterlockedIncrement(&pJob->nextTile) - 1;
+        if (tileIdx >= (LONG)pJob->tileCount)
+        {
+            break;
+        }
+
+        TILE_RECT tile;
+        GetTileRect(*pJob, tileIdx, tile);
+        BOOL isSame = UpdatePreviousTile(*pJob->pPlaneX, pHistory->previous.data(), tile);
+        pHistory->tileChanged[tileIdx] = (pHistory->generation == 0) || !isSame;
+    }
+}
+
+static VOID CALLBACK TileWorkCallback(PTP_CALLBACK_INSTANCE pInstance, PVOID pContext, PTP_WORK pWork)
+{
+    UNREFERENCED_PARAMETER(pInstance);
+    UNREFERENCED_PARAMETER(pWork);
+
+    PTILE_JOB pJob = (PTILE_JOB)pContext;
+    CONST PLANE_VIEW &planeX = *pJob->pPlaneX;
+    CONST PLANE_VIEW &planeY = *pJob->pPlaneY;
+    LONG tilesReused = 0;
+    for (;;)
+    {
+        LONG tileIdx = InterlockedIncrement(&pJob->nextTile) - 1;
+        if (tileIdx >= (LONG)pJob->tileCount)
+        {
+            break;
+        }
+
+        TILE_RECT tile;
+        GetTileRect(*pJob, tileIdx, tile);
+
+        PPAIR_STATS_CACHE pCache = pJob->pCache;
+        if (pJob->isCacheUsable &&
+            !pCache->pHistoryX->tileChanged[tileIdx] && !pCache->pHistoryY->tileChanged[tileIdx])
+        {
+            pJob->pPartials[tileIdx] = pCache->tiles[tileIdx];
+            tilesReused++;
+            continue;
+        }
+
+        if (planeX.bytesPerSample == 1)
+        {
+            AccumulateTile<BYTE>(planeX, planeY, tile, pJob->pPartials[tileIdx]);
+        }
+        else
+        {
+            AccumulateTile<UINT16>(planeX, planeY, tile, pJob->pPartials[tileIdx]);
+        }
+        if (pCache)
+        {
+            pCache->tiles[tileIdx] = pJob->pPartials[tileIdx];
+        }
+    }
+    InterlockedExchangeAdd(&pJob->tilesReused, tilesReused);
+}
+
+static void AddMoments(PAIR_MOMENTS &dst, CONST PAIR_MOMENTS &src)
+{
+    dst.count += src.count;
+    dst.sumX += src.sumX;
+    dst.sumY += src.sumY;
+    dst.sumXX += src.sumXX;
+    dst.sumYY += src.sumYY;
+    dst.sumXY += src.sumXY;
+}
+
+// Combine partials in a pairwise tree: (0+1)+(2+3), ... The sums are
+// integers, so the total is the same whichever thread produced which tile.
+static void ReducePairwise(std::vector<PAIR_MOMENTS> &partials)
+{
+    SIZE_T count = partials.size();
+    for (SIZE_T stride = 1; stride < count; stride *= 2)
+    {
+        for (SIZE_T idx = 0; idx + stride < count; idx += 2 * stride)
+        {
+            AddMoments(partials[idx], partials[idx + stride]);
+        }
+    }
+}
+
+// sumXY - sumX * sumY / count without cancellation. With sumX = qX * count + rX
+// the product splits into qX * sumY + qY * rX + rX * rY / count, the first two
+// terms are exact in 64 bits and only the last one, below count, is rounded.
+static double GetCentredSum(UINT64 sumXY, UINT64 sumX, UINT64 sumY, UINT64 count)
+{
+    UINT64 qX = sumX / count;
+    UINT64 rX = sumX % count;
+    UINT64 qY = sumY / count;
+    UINT64 rY = sumY % count;
+    UINT64 integerPart = qX * sumY + qY * rX;
+    double centred = (sumXY >= integerPart) ? (double)(sumXY - integerPart) : -(double)(integerPart - sumXY);
+    return centred - (double)rX * (double)rY / (double)count;
+}
+
+static BOOL IsValidPlane(CONST PLANE_VIEW &plane)
+{
+    return ((plane.bytesPerSample == 1) || (plane.bytesPerSample == 2)) &&
+        ((UINT64)plane.width * plane.height >= 2) &&
+        ((UINT64)plane.width * plane.height <= MAXUINT32);
+}
+
+static BOOL IsHistoryOf(CONST PLANE_HISTORY &history, CONST PLANE_VIEW &plane)
+{
+    return (history.generation > 0) && (history.width == plane.width) &&
+        (history.height == plane.height) && (history.bytesPerSample == plane.bytesPerSample);
+}
+
+void GetTileGrid(UINT32 width, UINT32 height, UINT32 &columns, UINT32 &rows)
+{
+    columns = (width + FRAME_STATS_TILE_WIDTH - 1) / FRAME_STATS_TILE_WIDTH;
+    rows = (height + FRAME_STATS_TILE_HEIGHT - 1) / FRAME_STATS_TILE_HEIGHT;
+}
+
+static void InitTileJob(TILE_JOB &job, CONST PLANE_VIEW &planeX, CONST PLANE_VIEW *pPlaneY)
+{
+    UINT32 tileRows = 0;
+    GetTileGrid(planeX.width, planeX.height, job.tileColumns, tileRows);
+    job.pPlaneX = &planeX;
+    job.pPlaneY = pPlaneY;
+    job.tileCount = job.tileColumns * tileRows;
+    job.nextTile = 0;
+    job.tilesReused = 0;
+}
+
+// Run the callback over every tile of the job on up to threadCount threads
+static void RunTileJob(PTP_WORK_CALLBACK pCallback, TILE_JOB &job, UINT32 threadCount)
+{
+    if (threadCount == 0)
+    {
+        SYSTEM_INFO sysInfo = { 0 };
+        GetSystemInfo(&sysInfo);
+        threadCount = sysInfo.dwNumberOfProcessors;
+    }
+    threadCount = min(threadCount, job.tileCount);
+
+    PTP_WORK pWork = NULL;
+    if (threadCount > 1)
+    {
+        pWork = CreateThreadpoolWork(pCallback, &job, NULL);
+    }
+    if (pWork)
+    {
+        // The calling thread takes tiles as well
+        for (UINT32 idx = 1; idx < threadCount; idx++)
+        {
+            SubmitThreadpoolWork(pWork);
+        }
+        pCallback(NULL, &job, NULL);
+        WaitForThreadpoolWorkCallbacks(pWork, FALSE);
+        CloseThreadpoolWork(pWork);
+    }
+    else
+    {
+        pCallback(NULL, &job, NULL);
+    }
+}
+
+HRESULT UpdatePlaneHistory(CONST PLANE_VIEW &plane, UINT32 threadCount, PLANE_HISTORY &history)
+{
+    HRESULT hr = IsValidPlane(plane) ? S_OK : E_INVALIDARG;
+
+    TILE_JOB job = { 0 };
+    if (SUCCEEDED(hr))
+    {
+        InitTileJob(job, plane, NULL);
+        job.pHistory = &history;
+        if (!IsHistoryOf(history, plane))
+        {
+            history.width = plane.width;
+            history.height = plane.height;
+            history.bytesPerSample = plane.bytesPerSample;
+            history.generation = 0;
+            history.previous.resize((SIZE_T)plane.width * plane.height * plane.bytesPerSample);
+            history.tileChanged.resize(job.tileCount);
+        }
+
+        RunTileJob(HistoryWorkCallback, job, threadCount);
+        history.generation++;
+    }
+
+    return hr;
+}
+
+void GetMomentStats(CONST PAIR_MOMENTS &moments, PAIR_STATS &stats)
+{
+    // A single sample has no spread, keep it from dividing by zero
+    double degrees = (moments.count > 1) ? (double)(moments.count - 1) : 1.0;
+    stats.averageX = (double)moments.sumX / (double)moments.count;
+    stats.averageY = (double)moments.sumY / (double)moments.count;
+    stats.varianceX = GetCentredSum(moments.sumXX, moments.sumX, moments.sumX, moments.count) / degrees;
+    stats.varianceY = GetCentredSum(moments.sumYY, moments.sumY, moments.sumY, moments.count) / degrees;
+    stats.covariance = GetCentredSum(moments.sumXY, moments.sumX, moments.sumY, moments.count) / degrees;
+}
+
+HRESULT ComputePairStats(CONST PLANE_VIEW &planeX, CONST PLANE_VIEW &planeY, UINT32 threadCount, PPAIR_STATS_CACHE pCache,
+    std::vector<PAIR_MOMENTS> *pTiles, PAIR_STATS &stats)
+{
+    HRESULT hr = S_OK;
+
+    if ((planeX.width != planeY.width) || (planeX.height != planeY.height) ||
+        (planeX.bytesPerSample != planeY.bytesPerSample) || !IsValidPlane(planeX))
+    {
+        hr = E_INVALIDARG;
+    }
+    if (SUCCEEDED(hr) && pCache &&
+        (!pCache->pHistoryX || !pCache->pHistoryY || !IsHistoryOf(*pCache->pHistoryX, planeX) || !IsHistoryOf(*pCache->pHistoryY, planeY)))
+    {
+        hr = E_INVALIDARG;
+    }
+
+    std::vector<PAIR_MOMENTS> partials;
+    TILE_JOB job = { 0 };
+    if (SUCCEEDED(hr))
+    {
+        InitTileJob(job, planeX, &planeY);
+        job.pCache = pCache;
+        partials.resize(job.tileCount);
+        job.pPartials = partials.data();
+
+        if (pCache)
+        {
+            // Tiles can only be reused when they belong to the frame right
+            // before the one both histories were just updated with
+            job.isCacheUsable = (pCache->tiles.size() == job.tileCount) &&
+                (pCache->generationX + 1 == pCache->pHistoryX->generation) &&
+                (pCache->generationY + 1 == pCache->pHistoryY->generation);
+            pCache->tiles.resize(job.tileCount);
+        }
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        RunTileJob(TileWorkCallback, job, threadCount);
+
+        if (pCache)
+        {
+            pCache->generationX = pCache->pHistoryX->generation;
+            pCache->generationY = pCache->pHistoryY->generation;
+            pCache->tilesReused += job.tilesReused;
+            pCache->tilesComputed += job.tileCount - job.tilesReused;
+        }
+
+        if (pTiles)
+        {
+            *pTiles = partials;
+        }
+
+        ReducePairwise(partials);
+        GetMomentStats(partials[0], stats);
+    }
+
+    return hr;
+}
+
+double CalculateSSIM(CONST PAIR_STATS &stats, double L)
+{
+    double k1 = 0.01;
+    double k2 = 0.03;
+    double c1 = pow((k1*L), 2.0);
+    double c2 = pow((k2*L), 2.0);
+    double ssimNumerator = (2 * stats.averageX * stats.averageY + c1) * (2 * stats.covariance + c2);
+    double ssimDenominator = (pow(stats.averageX, 2.0) + pow(stats.averageY, 2.0) + c1) * (stats.varianceX + stats.varianceY + c2);
+    return ssimNumerator / ssimDenominator;
+}
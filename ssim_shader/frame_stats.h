@@ -0,0 +1,93 @@
+// frame_stats.h : CPU statistics engine, reduces a pair of planes in tiles
+//
+
+#pragma once
+
+#include <vector>
+#include "ssim_common.h"
+
+// Tile size in samples. The tile grid only depends on the plane size, never
+// on the number of threads, so the reduction below has the same shape
+// everywhere.
+#define FRAME_STATS_TILE_HEIGHT 32
+#define FRAME_STATS_TILE_WIDTH  256
+
+typedef struct _PLANE_VIEW
+{
+    CONST BYTE *pData;
+    UINT32 width;
+    UINT32 height;
+    UINT32 pitch;           // In bytes
+    UINT32 bytesPerSample;  // 1, or 2 for little endian samples above 8 bits
+}PLANE_VIEW, *PPLANE_VIEW;
+
+// Raw moments of plane X against plane Y over a block of pixels. Integer
+// sums are exact for up to 16-bit samples and 2^32 pixels.
+typedef struct _PAIR_MOMENTS
+{
+    UINT64 count;
+    UINT64 sumX;
+    UINT64 sumY;
+    UINT64 sumXX;
+    UINT64 sumYY;
+    UINT64 sumXY;
+}PAIR_MOMENTS, *PPAIR_MOMENTS;
+
+typedef struct _PAIR_STATS
+{
+    double averageX;
+    double averageY;
+    double varianceX;
+    double varianceY;
+    double covariance;
+}PAIR_STATS, *PPAIR_STATS;
+
+// Previous frame of one plane and the tiles that changed in the last
+// update. Every pair reading the plane shares one history, so the copy is
+// kept once.
+typedef struct _PLANE_HISTORY
+{
+    UINT32 width;
+    UINT32 height;
+    UINT32 bytesPerSample;
+    UINT64 generation;              // Number of updates, 0 before the first
+    std::vector<BYTE> previous;     // Tightly packed copy of the last plane
+    std::vector<BYTE> tileChanged;  // One flag per tile
+}PLANE_HISTORY, *PPLANE_HISTORY;
+
+// Tile moments of the previous frame, reused for tiles unchanged in both
+// plane histories. Results are identical to a full recompute.
+typedef struct _PAIR_STATS_CACHE
+{
+    CONST PLANE_HISTORY *pHistoryX; // Updated for the current frame by the caller
+    CONST PLANE_HISTORY *pHistoryY;
+    UINT64 generationX;             // History generations the tiles belong to
+    UINT64 generationY;
+    std::vector<PAIR_MOMENTS> tiles;
+    UINT64 tilesReused;             // Totals over every frame seen
+    UINT64 tilesComputed;
+}PAIR_STATS_CACHE, *PPAIR_STATS_CACHE;
+
+// Split a luma plane into the two eye views of the given stereo layout
+HRESULT GetStereoEyeViews(CONST BYTE *pLuma, UINT32 width, UINT32 height, UINT32 pitch, UINT32 bytesPerSample, STEREO_TYPE sType, PLANE_VIEW views[STEREO_EYE_COUNT]);
+
+// Tiles across and down a plane, in the row major order tiles are kept in
+void GetTileGrid(UINT32 width, UINT32 height, UINT32 &columns, UINT32 &rows);
+
+// Compare a plane with the previous frame tile by tile and keep it as the
+// new previous frame. threadCount as for ComputePairStats.
+HRESULT UpdatePlaneHistory(CONST PLANE_VIEW &plane, UINT32 threadCount, PLANE_HISTORY &history);
+
+// Mean, variance and covariance of two equally sized planes, exact up to
+// the final rounding to double.
+// threadCount = 0 uses every logical processor. The result is bit-identical
+// for any threadCount. pCache is optional and carries tiles over to the next
+// frame, its histories have to be updated with planeX and planeY first.
+// pTiles is optional and receives the moments of every tile.
+HRESULT ComputePairStats(CONST PLANE_VIEW &planeX, CONST PLANE_VIEW &planeY, UINT32 threadCount, PPAIR_STATS_CACHE pCache,
+    std::vector<PAIR_MOMENTS> *pTiles, PAIR_STATS &stats);
+
+// Mean, variance and covariance of a block of moments
+void GetMomentStats(CONST PAIR_MOMENTS &moments, PAIR_STATS &stats);
+
+double CalculateSSIM(CONST PAIR_STATS &stats, double L);
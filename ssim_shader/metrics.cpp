@@ -0,0 +1,344 @@
+// metrics.cpp : per-thread counters and latency histograms, exported as
+// Prometheus text
+//
+
+#include "stdafx.h"
+#include <stdarg.h>
+#include <string.h>
+#include <string>
+#include "metrics.h"
+#include "debug_dump.h"
+
+#define METRICS_TEMP_EXTENSION  L".tmp"
+
+typedef struct _METRIC_DESC
+{
+    PCSTR name;
+    PCSTR label;    // NULL when the family has a single series
+    PCSTR help;
+}METRIC_DESC, *PMETRIC_DESC;
+
+// Series of one family have to stay next to each other
+static CONST METRIC_DESC COUNTER_DESC[] = {
+    { "ssim_frames_processed_total", NULL,                  "Frames processed" },
+    { "ssim_frames_total",           "result=\"pass\"",     "Frames by stereo validation result" },
+    { "ssim_frames_total",           "result=\"fail\"",     "Frames by stereo validation result" },
+    { "ssim_frames_total",           "result=\"error\"",    "Frames by stereo validation result" },
+    { "ssim_read_bytes_total",       NULL,                  "Luma bytes read from the input files" },
+    { "ssim_tiles_total",            "result=\"reused\"",   "Statistics tiles by incremental cache result" },
+    { "ssim_tiles_total",            "result=\"computed\"", "Statistics tiles by incremental cache result" },
+};
+
+static CONST PCSTR HISTOGRAM_STAGE_NAME[] = {
+    "read",
+    "stereo",
+    "reference",
+    "frame",
+};
+
+// Upper bounds in microseconds, one more bucket catches everything above
+static CONST UINT64 HISTOGRAM_BUCKET_BOUND[] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000,
+};
+#define HISTOGRAM_BUCKET_COUNT (ARRAYSIZE(HISTOGRAM_BUCKET_BOUND) + 1)
+
+// One cache line aligned block per thread, so updates never share a line
+typedef struct DECLSPEC_ALIGN(64) _METRICS_SLOT
+{
+    volatile LONG64 counters[METRIC_COUNTER_COUNT];
+    volatile LONG64 buckets[METRIC_HISTOGRAM_COUNT][HISTOGRAM_BUCKET_COUNT];
+    volatile LONG64 sums[METRIC_HISTOGRAM_COUNT];   // Microseconds
+}METRICS_SLOT, *PMETRICS_SLOT;
+
+typedef struct _METRICS_CONTEXT
+{
+    BOOL isRunning;
+    WCHAR fileName[MAX_PATH];
+    WCHAR tempFileName[MAX_PATH];
+    UINT32 intervalMs;
+    LARGE_INTEGER qpcFrequency;
+    HANDLE hStopEvent;
+    HANDLE hExporterThread;
+    volatile LONG slotCount;
+    METRICS_SLOT slots[METRICS_MAX_THREADS];
+    METRICS_SLOT sharedSlot;
+}METRICS_CONTEXT, *PMETRICS_CONTEXT;
+
+static METRICS_CONTEXT g_MetricsCtx;
+static __declspec(thread) PMETRICS_SLOT t_pMetricsSlot = NULL;
+
+static PMETRICS_SLOT GetThreadSlot()
+{
+    if (t_pMetricsSlot == NULL)
+    {
+        LONG slotIdx = InterlockedIncrement(&g_MetricsCtx.slotCount) - 1;
+        t_pMetricsSlot = (slotIdx < METRICS_MAX_THREADS) ? &g_MetricsCtx.slots[slotIdx] : &g_MetricsCtx.sharedSlot;
+    }
+    return t_pMetricsSlot;
+}
+
+// A slot has a single writer, so a plain add is enough where 64-bit stores
+// are atomic. The shared overflow slot and 32-bit builds use interlocked adds.
+static void AddToSlot(PMETRICS_SLOT pSlot, volatile LONG64 &value, LONG64 delta)
+{
+#if defined(_WIN64)
+    if (pSlot != &g_MetricsCtx.sharedSlot)
+    {
+        value += delta;
+        return;
+    }
+#else
+    UNREFERENCED_PARAMETER(pSlot);
+#endif
+    InterlockedExchangeAdd64(&value, delta);
+}
+
+static LONG64 ReadSlotValue(volatile LONG64 &value)
+{
+#if defined(_WIN64)
+    return value;
+#else
+    return InterlockedCompareExchange64(&value, 0, 0);
+#endif
+}
+
+static void AppendText(std::string &text, PCSTR pFormat, ...)
+{
+    CHAR line[512];
+    va_list args;
+    va_start(args, pFormat);
+    INT length = vsprintf_s(line, ARRAYSIZE(line), pFormat, args);
+    va_end(args);
+    if (length > 0)
+    {
+        text.append(line, length);
+    }
+}
+
+static void FormatMetrics(std::string &text)
+{
+    LONG64 counters[METRIC_COUNTER_COUNT] = { 0 };
+    LONG64 buckets[METRIC_HISTOGRAM_COUNT][HISTOGRAM_BUCKET_COUNT] = { 0 };
+    LONG64 sums[METRIC_HISTOGRAM_COUNT] = { 0 };
+
+    LONG slotCount = min(g_MetricsCtx.slotCount, (LONG)METRICS_MAX_THREADS);
+    for (LONG slotIdx = 0; slotIdx <= slotCount; slotIdx++)
+    {
+        METRICS_SLOT &slot = (slotIdx < slotCount) ? g_MetricsCtx.slots[slotIdx] : g_MetricsCtx.sharedSlot;
+        for (UINT idx = 0; idx < METRIC_COUNTER_COUNT; idx++)
+        {
+            counters[idx] += ReadSlotValue(slot.counters[idx]);
+        }
+        for (UINT histIdx = 0; histIdx < METRIC_HISTOGRAM_COUNT; histIdx++)
+        {
+            for (UINT bucketIdx = 0; bucketIdx < HISTOGRAM_BUCKET_COUNT; bucketIdx++)
+            {
+                buckets[histIdx][bucketIdx] += ReadSlotValue(slot.buckets[histIdx][bucketIdx]);
+            }
+            sums[histIdx] += ReadSlotValue(slot.sums[histIdx]);
+        }
+    }
+
+    for (UINT idx = 0; idx < METRIC_COUNTER_COUNT; idx++)
+    {
+        CONST METRIC_DESC &desc = COUNTER_DESC[idx];
+        if ((idx == 0) || (strcmp(desc.name, COUNTER_DESC[idx - 1].name) != 0))
+        {
+            AppendText(text, "# HELP %s %s\n# TYPE %s counter\n", desc.name, desc.help, desc.name);
+        }
+        if (desc.label)
+        {
+            AppendText(text, "%s{%s} %lld\n", desc.name, desc.label, counters[idx]);
+        }
+        else
+        {
+            AppendText(text, "%s %lld\n", desc.name, counters[idx]);
+        }
+    }
+
+    UINT32 queueDepth = 0;
+    UINT64 droppedCount = 0;
+    DebugDumpGetQueueStats(queueDepth, droppedCount);
+    AppendText(text, "# HELP ssim_dump_queue_depth Debug dumps waiting for the writer thread, a GPU texture with its mips counts once\n# TYPE ssim_dump_queue_depth gauge\n");
+    AppendText(text, "ssim_dump_queue_depth %u\n", queueDepth);
+    AppendText(text, "# HELP ssim_dump_dropped_total Debug dumps dropped, counted like ssim_dump_queue_depth\n# TYPE ssim_dump_dropped_total counter\n");
+    AppendText(text, "ssim_dump_dropped_total %llu\n", droppedCount);
+
+    AppendText(text, "# HELP ssim_stage_duration_seconds Latency of one frame per processing stage\n");
+    AppendText(text, "# TYPE ssim_stage_duration_seconds histogram\n");
+    for (UINT histIdx = 0; histIdx < METRIC_HISTOGRAM_COUNT; histIdx++)
+    {
+        PCSTR pStage = HISTOGRAM_STAGE_NAME[histIdx];
+        LONG64 cumulative = 0;
+        for (UINT bucketIdx = 0; bucketIdx < HISTOGRAM_BUCKET_COUNT; bucketIdx++)
+        {
+            cumulative += buckets[histIdx][bucketIdx];
+            if (bucketIdx < ARRAYSIZE(HISTOGRAM_BUCKET_BOUND))
+            {
+                AppendText(text, "ssim_stage_duration_seconds_bucket{stage=\"%s\",le=\"%g\"} %lld\n",
+                    pStage, HISTOGRAM_BUCKET_BOUND[bucketIdx] / 1000000.0, cumulative);
+            }
+            else
+            {
+                AppendText(text, "ssim_stage_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %lld\n", pStage, cumulative);
+            }
+        }
+        AppendText(text, "ssim_stage_duration_seconds_sum{stage=\"%s\"} %.6f\n", pStage, sums[histIdx] / 1000000.0);
+        AppendText(text, "ssim_stage_duration_seconds_count{stage=\"%s\"} %lld\n", pStage, cumulative);
+    }
+}
+
+// Readers only ever see a complete file: write a temp file, then swap it in
+static HRESULT WriteMetricsFile()
+{
+    HRESULT hr = S_OK;
+    std::string text;
+    FormatMetrics(text);
+
+    HANDLE hFile = CreateFile(g_MetricsCtx.tempFileName, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+    }
+    DWORD bytesWritten = 0;
+    if (SUCCEEDED(hr) && !WriteFile(hFile, text.data(), (DWORD)text.size(), &bytesWritten, NULL))
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+    }
+    SafeCloseHandle(hFile);
+
+    if (SUCCEEDED(hr) && !MoveFileEx(g_MetricsCtx.tempFileName, g_MetricsCtx.fileName, MOVEFILE_REPLACE_EXISTING))
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    return hr;
+}
+
+static DWORD WINAPI MetricsExporterThread(LPVOID pParam)
+{
+    UNREFERENCED_PARAMETER(pParam);
+
+    while (WaitForSingleObject(g_MetricsCtx.hStopEvent, g_MetricsCtx.intervalMs) == WAIT_TIMEOUT)
+    {
+        WriteMetricsFile();
+    }
+    return 0;
+}
+
+HRESULT MetricsStart(CONST PWCHAR pFileName, UINT32 intervalMs)
+{
+    HRESULT hr = S_OK;
+
+    if (g_MetricsCtx.isRunning || (intervalMs == 0) ||
+        (wcslen(pFileName) + wcslen(METRICS_TEMP_EXTENSION) >= MAX_PATH))
+    {
+        hr = E_INVALIDARG;
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        wcscpy_s(g_MetricsCtx.fileName, ARRAYSIZE(g_MetricsCtx.fileName), pFileName);
+        swprintf_s(g_MetricsCtx.tempFileName, ARRAYSIZE(g_MetricsCtx.tempFileName), L"%s%s", pFileName, METRICS_TEMP_EXTENSION);
+        g_MetricsCtx.intervalMs = intervalMs;
+        QueryPerformanceFrequency(&g_MetricsCtx.qpcFrequency);
+
+        g_MetricsCtx.hStopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+        if (g_MetricsCtx.hStopEvent == NULL)
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+        }
+    }
+    if (SUCCEEDED(hr))
+    {
+        // The file is there from the start, even before the first interval
+        hr = WriteMetricsFile();
+    }
+    if (SUCCEEDED(hr))
+    {
+        g_MetricsCtx.hExporterThread = CreateThread(NULL, 0, MetricsExporterThread, NULL, 0, NULL);
+        if (g_MetricsCtx.hExporterThread == NULL)
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+        }
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        SetThreadPriority(g_MetricsCtx.hExporterThread, THREAD_PRIORITY_BELOW_NORMAL);
+        g_MetricsCtx.isRunning = TRUE;
+    }
+    else
+    {
+        SafeCloseHandle(g_MetricsCtx.hStopEvent);
+    }
+
+    return hr;
+}
+
+void MetricsStop()
+{
+    if (!g_MetricsCtx.isRunning)
+    {
+        return;
+    }
+
+    SetEvent(g_MetricsCtx.hStopEvent);
+    WaitForSingleObject(g_MetricsCtx.hExporterThread, INFINITE);
+    SafeCloseHandle(g_MetricsCtx.hExporterThread);
+    SafeCloseHandle(g_MetricsCtx.hStopEvent);
+
+    WriteMetricsFile();
+    g_MetricsCtx.isRunning = FALSE;
+}
+
+void MetricsAdd(METRIC_COUNTER counter, UINT64 value)
+{
+    if (!g_MetricsCtx.isRunning)
+    {
+        return;
+    }
+
+    PMETRICS_SLOT pSlot = GetThreadSlot();
+    AddToSlot(pSlot, pSlot->counters[counter], (LONG64)value);
+}
+
+void MetricsObserve(METRIC_HISTOGRAM histogram, UINT64 microseconds)
+{
+    if (!g_MetricsCtx.isRunning)
+    {
+        return;
+    }
+
+    UINT bucketIdx = 0;
+    while ((bucketIdx < ARRAYSIZE(HISTOGRAM_BUCKET_BOUND)) && (microseconds > HISTOGRAM_BUCKET_BOUND[bucketIdx]))
+    {
+        bucketIdx++;
+    }
+
+    PMETRICS_SLOT pSlot = GetThreadSlot();
+    AddToSlot(pSlot, pSlot->buckets[histogram][bucketIdx], 1);
+    AddToSlot(pSlot, pSlot->sums[histogram], (LONG64)microseconds);
+}
+
+LONGLONG MetricsNow()
+{
+    LARGE_INTEGER now = { 0 };
+    if (g_MetricsCtx.isRunning)
+    {
+        QueryPerformanceCounter(&now);
+    }
+    return now.QuadPart;
+}
+
+void MetricsObserveSince(METRIC_HISTOGRAM histogram, LONGLONG start)
+{
+    if (!g_MetricsCtx.isRunning || (start == 0))
+    {
+        return;
+    }
+
+    LARGE_INTEGER now = { 0 };
+    QueryPerformanceCounter(&now);
+    MetricsObserve(histogram, (UINT64)((now.QuadPart - start) * 1000000 / g_MetricsCtx.qpcFrequency.QuadPart));
+}
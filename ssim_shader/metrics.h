@@ -0,0 +1,46 @@
+// metrics.h : per-thread counters and latency histograms, exported as
+// Prometheus text
+//
+
+#pragma once
+
+#include "ssim_common.h"
+
+// Threads beyond this share one slot updated with interlocked operations
+#define METRICS_MAX_THREADS         128
+#define METRICS_DEFAULT_INTERVAL_MS 1000
+
+typedef enum _METRIC_COUNTER
+{
+    METRIC_COUNTER_FRAMES,          // Frames processed, any result
+    METRIC_COUNTER_FRAMES_PASS,
+    METRIC_COUNTER_FRAMES_FAIL,
+    METRIC_COUNTER_FRAMES_ERROR,
+    METRIC_COUNTER_BYTES_READ,
+    METRIC_COUNTER_TILES_REUSED,    // Incremental cache hits
+    METRIC_COUNTER_TILES_COMPUTED,
+    METRIC_COUNTER_COUNT,
+}METRIC_COUNTER, *PMETRIC_COUNTER;
+
+typedef enum _METRIC_HISTOGRAM
+{
+    METRIC_HISTOGRAM_READ,          // Luma read of one frame
+    METRIC_HISTOGRAM_STEREO,        // Stereo statistics of one frame
+    METRIC_HISTOGRAM_REFERENCE,     // Full-reference statistics of one frame
+    METRIC_HISTOGRAM_FRAME,         // Whole frame, read to SSIM
+    METRIC_HISTOGRAM_COUNT,
+}METRIC_HISTOGRAM, *PMETRIC_HISTOGRAM;
+
+// Start the exporter thread, pFileName is rewritten every intervalMs
+HRESULT MetricsStart(CONST PWCHAR pFileName, UINT32 intervalMs);
+
+// Write a final snapshot and stop the exporter thread
+void MetricsStop();
+
+// Both are no-ops unless the exporter is running
+void MetricsAdd(METRIC_COUNTER counter, UINT64 value);
+void MetricsObserve(METRIC_HISTOGRAM histogram, UINT64 microseconds);
+
+// Timestamp for MetricsObserveSince, 0 when metrics are off
+LONGLONG MetricsNow();
+void MetricsObserveSince(METRIC_HISTOGRAM histogram, LONGLONG start);
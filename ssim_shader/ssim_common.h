@@ -0,0 +1,48 @@
+// ssim_common.h : helpers and types shared by the GPU and CPU statistics paths
+//
+
+#pragma once
+
+#include <Windows.h>
+
+template <class T> inline void SafeRelease(T*& pT)
+{
+    if (pT != nullptr)
+    {
+        pT->Release();
+        pT = nullptr;
+    }
+}
+
+inline void SafeCloseHandle(HANDLE& h)
+{
+    if ((h != nullptr) && (h != INVALID_HANDLE_VALUE))
+    {
+        ::CloseHandle(h);
+    }
+    h = nullptr;
+}
+
+template <class T> inline void SafeFree(T*& pT)
+{
+    if (pT != nullptr)
+    {
+        ::free(pT);
+        pT = nullptr;
+    }
+}
+
+typedef enum _STEREO_TYPE
+{
+    STEREO_TYPE_2D,
+    STEREO_TYPE_3D_SBS,
+    STEREO_TYPE_3D_TB,
+    STEREO_TYPE_COUNT,
+}STEREO_TYPE, *PSTEREO_TYPE;
+
+typedef enum _STEREO_EYE
+{
+    STEREO_EYE_LEFT = 0,
+    STEREO_EYE_RIGHT = 1,
+    STEREO_EYE_COUNT = 2,
+}STEREO_EYE, *PSTEREO_EYE;
@@ -12,40 +12,11 @@
 #include "Average_PS.h"
 #include "Variance_PS.h"
 #include "Covariance_PS.h"
-
-template <class T> inline void SafeRelease(T*& pT)
-{
-    if (pT != nullptr)
-    {
-        pT->Release();
-        pT = nullptr;
-    }
-}
-
-inline void SafeCloseHandle(HANDLE& h)
-{
-    if (h != nullptr)
-    {
-        ::CloseHandle(h);
-        h = nullptr;
-    }
-}
-
-template <class T> inline void SafeFree(T*& pT)
-{
-    if (pT != nullptr)
-    {
-        ::free(pT);
-        pT = nullptr;
-    }
-}
-
-typedef enum _STEREO_TYPE
-{
-    STEREO_TYPE_2D,
-    STEREO_TYPE_3D_SBS,
-    STEREO_TYPE_3D_TB,
-}STEREO_TYPE, *PSTEREO_TYPE;
+#include "ssim_common.h"
+#include "frame_stats.h"
+#include "frame_source.h"
+#include "debug_dump.h"
+#include "metrics.h"
 
 const PCHAR STEREO_TYPE_NAME[] = {
     "2D", 
@@ -56,12 +27,9 @@ const PCHAR STEREO_TYPE_NAME[] = {
 #define VALIDATE_PASS_MSG "Stereo mode validation result: PASS"
 #define VALIDATE_FAIL_MSG "Stereo mode validation result: FAIL"
 
-typedef enum _STEREO_EYE
-{
-    STEREO_EYE_LEFT = 0,
-    STEREO_EYE_RIGHT = 1,
-    STEREO_EYE_COUNT = 2,
-}STEREO_EYE, *PSTEREO_EYE;
+#define SSIM_PASS_THRESHOLD 0.8
+// Enough digits to round trip a double
+#define SSIM_FORMAT "%.17g"
 
 using namespace DirectX;
 
@@ -84,69 +52,94 @@ struct CBAveragePair
     float pad[2];
 };
 
-void ProcessCapture(ID3D11Device* pDev, ID3D11DeviceContext* pDevCtx, ID3D11Texture2D *pData)
-{
-    BOOL isSuccess = TRUE;
-    HRESULT hr = S_OK;
-
-    BYTE* pBits = NULL;
-    DWORD width = 0;
-    DWORD height = 0;
-    DWORD pitch = 0;
-
-    D3D11_TEXTURE2D_DESC Desc;
-    pData->GetDesc(&Desc);
-
-    ID3D11Texture2D* pCaptureTex = nullptr;
-
-    D3D11_TEXTURE2D_DESC DescCapture;
-    DescCapture = Desc;
-    DescCapture.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
-    DescCapture.Usage = D3D11_USAGE_STAGING;
-    DescCapture.MiscFlags = 0;
-    DescCapture.BindFlags = 0;
-    hr = pDev->CreateTexture2D(&DescCapture, nullptr, &pCaptureTex);
-
-    SYSTEMTIME curTime = { 0 };
-    GetLocalTime(&curTime);
-    wchar_t path[MAX_PATH * 2];
-    ZeroMemory(path, MAX_PATH * 2 * sizeof(wchar_t));
-    GetCurrentDirectory(MAX_PATH * 2, path);
-
-    wchar_t buf[MAX_PATH * 2];
-    ZeroMemory(buf, MAX_PATH * 2 * sizeof(wchar_t));
-
-    pDevCtx->CopyResource(pCaptureTex, pData);
+// Every eye is resampled to a square target this wide, 2^10
+#define GPU_TARGET_SIDE 1024
 
-    for (UINT resIdx = 0; (SUCCEEDED(hr)) && (resIdx < Desc.MipLevels * Desc.ArraySize); resIdx++)
-    {
-        UINT mipSlice = resIdx % Desc.MipLevels;
-        UINT arraySlice = resIdx / Desc.MipLevels;
-        UINT idx = D3D11CalcSubresource(mipSlice, arraySlice, Desc.MipLevels);
-
-        D3D11_MAPPED_SUBRESOURCE mappedResource = { 0 };
-        hr = pDevCtx->Map(pCaptureTex, idx, D3D11_MAP_READ, 0, &mappedResource);
-        pBits = (PBYTE)mappedResource.pData;
-        pitch = mappedResource.RowPitch;
-        width = Desc.Width >> (1 * mipSlice);
-        height = Desc.Height >> (1 * mipSlice);
-
-        FILE *pFile = NULL;
-        swprintf_s(buf, MAX_PATH * 2, L"%s\\%04d%02d%02d_%02d%02d%02d-%03d_array%d_mip%d.y",
-            path, curTime.wYear, curTime.wMonth, curTime.wDay, curTime.wHour, curTime.wMinute, curTime.wSecond, curTime.wMilliseconds, arraySlice, mipSlice);
-        if (_wfopen_s(&pFile, buf, L"wb") == 0)
-        {
-            fwrite(pBits, pitch * height, 1, pFile);
-            fclose(pFile);
-        }
+static CONST WORD QUAD_INDICES[] =
+{
+    0, 1, 3,
+    3, 1, 2,
+};
 
-        pDevCtx->Unmap(pCaptureTex, idx);
-    }
-    if (pCaptureTex)
-    {
-        pCaptureTex->Release();
-    }
-}
+// Device objects that live across frames
+typedef struct _GPU_ENGINE
+{
+    ID3D11Device *pDx11Dev;
+    ID3D11DeviceContext *pDx11DevCtx;
+    ID3D11VertexShader *pVSPassThrough;
+    ID3D11InputLayout *pInputLayout;
+    ID3D11PixelShader *pPSAverage;
+    ID3D11PixelShader *pPSVariance;
+    ID3D11PixelShader *pPSCovariance;
+    ID3D11Buffer *pIB;
+    ID3D11SamplerState *pSamplerLinear;
+    // Sized from the stream header, every frame reuses them
+    UINT32 width;
+    UINT32 height;
+    ID3D11Texture2D *pTexYUV;
+    ID3D11ShaderResourceView *pSrvYUV;
+    ID3D11Texture2D *pSSIMTex[STEREO_EYE_COUNT];
+    ID3D11RenderTargetView *pSSIMTexRtv[STEREO_EYE_COUNT];
+    ID3D11ShaderResourceView *pSSIMTexSrv[STEREO_EYE_COUNT];
+    ID3D11Texture2D *pSSIMTexVariance[STEREO_EYE_COUNT];
+    ID3D11RenderTargetView *pSSIMTexVarianceRtv[STEREO_EYE_COUNT];
+    ID3D11ShaderResourceView *pSSIMTexVarianceSrv[STEREO_EYE_COUNT];
+    ID3D11Texture2D *pSSIMTexCovariance;
+    ID3D11RenderTargetView *pSSIMTexCovarianceRtv;
+    ID3D11ShaderResourceView *pSSIMTexCovarianceSrv;
+    ID3D11Buffer *pVB[STEREO_EYE_COUNT];
+    ID3D11Buffer *pVBCovariance;
+    ID3D11Buffer *pCBAverageSingle[STEREO_EYE_COUNT];
+    ID3D11Buffer *pCBAveragePair;
+    ID3D11Texture2D *pReadbackTex;  // 1x1 staging copy of the last mip
+}GPU_ENGINE, *PGPU_ENGINE;
+
+typedef struct _SSIM_OPTIONS
+{
+    PWCHAR pFileName;
+    PWCHAR pRefFileName;    // Full-reference source, pFileName is then the distorted one
+    UINT32 width;           // Raw .yuv only
+    UINT32 height;
+    STEREO_TYPE sType;
+    BOOL useCpu;
+    BOOL isIncremental;     // Reuse unchanged tiles of the previous frame (CPU)
+    UINT32 threadCount;     // Per worker, 0 = all cores
+    UINT32 workerCount;
+    UINT64 frameStart;
+    UINT64 frameCount;      // 0 runs to the end of the file
+}SSIM_OPTIONS, *PSSIM_OPTIONS;
+
+typedef struct _FRAME_RESULT
+{
+    HRESULT hr;
+    double ssim;
+    double refSsim[STEREO_EYE_COUNT];   // Against the reference, per eye
+    double refSsimCombined;
+    UINT64 tilesReused;
+    UINT64 tilesComputed;
+}FRAME_RESULT, *PFRAME_RESULT;
+
+// Incremental state of one worker. The previous frame is kept once per eye
+// and shared by the stereo cache and the reference caches.
+typedef struct _FRAME_HISTORY
+{
+    PLANE_HISTORY eyes[STEREO_EYE_COUNT];
+    PLANE_HISTORY refEyes[STEREO_EYE_COUNT];
+    PAIR_STATS_CACHE stereoCache;
+    PAIR_STATS_CACHE refCaches[STEREO_EYE_COUNT];
+}FRAME_HISTORY, *PFRAME_HISTORY;
+
+// One contiguous shard of the frame range
+typedef struct _FRAME_WORKER
+{
+    CONST SSIM_OPTIONS *pOptions;
+    CONST FRAME_SOURCE *pSource;    // Opened and indexed once, cloned per worker
+    CONST FRAME_SOURCE *pRefSource; // NULL without -ref
+    UINT64 frameStart;
+    UINT64 frameEnd;
+    PFRAME_RESULT pResults;     // Result of frameStart onward
+    HRESULT hr;
+}FRAME_WORKER, *PFRAME_WORKER;
 
 HRESULT AdjustStereoVertexBuffer(VERTEX *pVB, BOOL isRightEye, STEREO_TYPE sType)
 {
@@ -225,63 +218,238 @@ HRESULT AdjustStereoVertexBuffer(VERTEX *pVB, BOOL isRightEye, STEREO_TYPE sType
     return hr;
 }
 
-UINT GetMip1Value(ID3D11Device* pDev, ID3D11DeviceContext* pDevCtx, ID3D11Texture2D *pData)
+// Read the 1x1 mip, the average of the whole target. pReadbackTex is a 1x1
+// R32_FLOAT staging texture reused by every read.
+float GetMip1Value(ID3D11DeviceContext* pDevCtx, ID3D11Texture2D *pReadbackTex, ID3D11Texture2D *pData)
 {
-    UINT pixVal = 0;
+    float pixVal = 0.0f;
     HRESULT hr = S_OK;
 
     D3D11_TEXTURE2D_DESC Desc;
     pData->GetDesc(&Desc);
 
-    ID3D11Texture2D* pCaptureTex = nullptr;
-
-    D3D11_TEXTURE2D_DESC DescCapture;
-    DescCapture = Desc;
-    DescCapture.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
-    DescCapture.Usage = D3D11_USAGE_STAGING;
-    DescCapture.MiscFlags = 0;
-    DescCapture.BindFlags = 0;
-    hr = pDev->CreateTexture2D(&DescCapture, nullptr, &pCaptureTex);
-    if(SUCCEEDED(hr))
-    {
-        pDevCtx->CopyResource(pCaptureTex, pData);
-        UINT mipSlice = (Desc.MipLevels * Desc.ArraySize - 1) % Desc.MipLevels;
-        UINT arraySlice = (Desc.MipLevels * Desc.ArraySize - 1) / Desc.MipLevels;
-        UINT idx = D3D11CalcSubresource(mipSlice, arraySlice, Desc.MipLevels);
-        D3D11_MAPPED_SUBRESOURCE mappedResource = { 0 };
-        hr = pDevCtx->Map(pCaptureTex, idx, D3D11_MAP_READ, 0, &mappedResource);
+    UINT mipSlice = (Desc.MipLevels * Desc.ArraySize - 1) % Desc.MipLevels;
+    UINT arraySlice = (Desc.MipLevels * Desc.ArraySize - 1) / Desc.MipLevels;
+    UINT idx = D3D11CalcSubresource(mipSlice, arraySlice, Desc.MipLevels);
+    pDevCtx->CopySubresourceRegion(pReadbackTex, 0, 0, 0, 0, pData, idx, NULL);
+
+    D3D11_MAPPED_SUBRESOURCE mappedResource = { 0 };
+    hr = pDevCtx->Map(pReadbackTex, 0, D3D11_MAP_READ, 0, &mappedResource);
+    if (SUCCEEDED(hr))
+    {
+        pixVal = *((float*)mappedResource.pData);
+        pDevCtx->Unmap(pReadbackTex, 0);
+    }
+    return pixVal;
+}
+
+void ReleaseGpuEngine(GPU_ENGINE &engine)
+{
+    if (engine.pDx11DevCtx)
+    {
+        DebugDumpPoll(engine.pDx11DevCtx, TRUE);
+    }
+    DebugDumpReleaseStagingPool();
+    for (UINT eyeIdx = 0; eyeIdx < STEREO_EYE_COUNT; eyeIdx++)
+    {
+        SafeRelease(engine.pCBAverageSingle[eyeIdx]);
+        SafeRelease(engine.pVB[eyeIdx]);
+        SafeRelease(engine.pSSIMTexVarianceSrv[eyeIdx]);
+        SafeRelease(engine.pSSIMTexVarianceRtv[eyeIdx]);
+        SafeRelease(engine.pSSIMTexVariance[eyeIdx]);
+        SafeRelease(engine.pSSIMTexSrv[eyeIdx]);
+        SafeRelease(engine.pSSIMTexRtv[eyeIdx]);
+        SafeRelease(engine.pSSIMTex[eyeIdx]);
+    }
+    SafeRelease(engine.pReadbackTex);
+    SafeRelease(engine.pVBCovariance);
+    SafeRelease(engine.pSSIMTexCovarianceSrv);
+    SafeRelease(engine.pSSIMTexCovarianceRtv);
+    SafeRelease(engine.pSSIMTexCovariance);
+    SafeRelease(engine.pCBAveragePair);
+    SafeRelease(engine.pSrvYUV);
+    SafeRelease(engine.pTexYUV);
+    SafeRelease(engine.pVSPassThrough);
+    SafeRelease(engine.pInputLayout);
+    SafeRelease(engine.pPSCovariance);
+    SafeRelease(engine.pPSVariance);
+    SafeRelease(engine.pPSAverage);
+    SafeRelease(engine.pIB);
+    SafeRelease(engine.pSamplerLinear);
+    SafeRelease(engine.pDx11DevCtx);
+    SafeRelease(engine.pDx11Dev);
+}
+
+// Textures, views and buffers of one frame. The stream has a fixed size
+// and layout, so they are created once and reused for every frame.
+HRESULT CreateGpuFrameResources(GPU_ENGINE &engine, UINT32 width, UINT32 height, STEREO_TYPE sType)
+{
+    HRESULT hr = S_OK;
+    ID3D11Device *pDx11Dev = engine.pDx11Dev;
+
+    engine.width = width;
+    engine.height = height;
+
+    D3D11_TEXTURE2D_DESC texYUVDesc = { 0 };
+    texYUVDesc.Width = width;
+    texYUVDesc.Height = height;
+    texYUVDesc.MipLevels = 1;
+    texYUVDesc.ArraySize = 1;
+    texYUVDesc.Format = DXGI_FORMAT_R8_UNORM;
+    texYUVDesc.SampleDesc.Count = 1;
+    texYUVDesc.SampleDesc.Quality = 0;
+    texYUVDesc.Usage = D3D11_USAGE_DEFAULT;
+    texYUVDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+    texYUVDesc.CPUAccessFlags = 0;
+    texYUVDesc.MiscFlags = 0;
+    hr = pDx11Dev->CreateTexture2D(&texYUVDesc, NULL, &engine.pTexYUV);
+
+    D3D11_SHADER_RESOURCE_VIEW_DESC srvYUVDesc = { DXGI_FORMAT_UNKNOWN, D3D_SRV_DIMENSION_UNKNOWN,{ 0 } };
+    srvYUVDesc.Format = DXGI_FORMAT_R8_UNORM;
+    srvYUVDesc.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE2D;
+    srvYUVDesc.Texture2D.MostDetailedMip = 0;
+    srvYUVDesc.Texture2D.MipLevels = texYUVDesc.MipLevels;
+    if (SUCCEEDED(hr))
+    {
+        hr = pDx11Dev->CreateShaderResourceView(engine.pTexYUV, &srvYUVDesc, &engine.pSrvYUV);
+    }
+
+    D3D11_TEXTURE2D_DESC ssimTexDesc = { 0 };
+    D3D11_RENDER_TARGET_VIEW_DESC rtvDesc = { DXGI_FORMAT_UNKNOWN, D3D11_RTV_DIMENSION_UNKNOWN,{ 0 } };
+    D3D11_SHADER_RESOURCE_VIEW_DESC srvDesc = { DXGI_FORMAT_UNKNOWN, D3D_SRV_DIMENSION_UNKNOWN,{ 0 } };
+    RtlCopyMemory(&ssimTexDesc, &texYUVDesc, sizeof(texYUVDesc));
+    // Float targets keep negative covariance and are not quantized before
+    // every mip level averages them
+    ssimTexDesc.Format = DXGI_FORMAT_R32_FLOAT;
+    ssimTexDesc.Width = GPU_TARGET_SIDE;
+    ssimTexDesc.Height = GPU_TARGET_SIDE;
+    ssimTexDesc.BindFlags = D3D11_BIND_RENDER_TARGET | D3D11_BIND_SHADER_RESOURCE;
+    ssimTexDesc.MiscFlags = D3D11_RESOURCE_MISC_GENERATE_MIPS;
+    ssimTexDesc.MipLevels = 0;
+
+    rtvDesc.Format = ssimTexDesc.Format;
+    rtvDesc.ViewDimension = D3D11_RTV_DIMENSION_TEXTURE2D;
+    rtvDesc.Texture2DArray.MipSlice = 0;
+
+    srvDesc.Format = ssimTexDesc.Format;
+    srvDesc.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE2D;
+    srvDesc.Texture2D.MostDetailedMip = 0;
+    srvDesc.Texture2D.MipLevels = -1;
+
+    VERTEX vertices[4];
+    D3D11_BUFFER_DESC BufferDesc;
+    D3D11_SUBRESOURCE_DATA InitData;
+    ZeroMemory(&InitData, sizeof(InitData));
+    InitData.pSysMem = vertices;
+
+    for (UINT eyeIdx = 0; SUCCEEDED(hr) && (eyeIdx < STEREO_EYE_COUNT); eyeIdx++)
+    {
+        hr = pDx11Dev->CreateTexture2D(&ssimTexDesc, NULL, &engine.pSSIMTex[eyeIdx]);
+        if (SUCCEEDED(hr))
+        {
+            hr = pDx11Dev->CreateTexture2D(&ssimTexDesc, NULL, &engine.pSSIMTexVariance[eyeIdx]);
+        }
+        if (SUCCEEDED(hr))
+        {
+            hr = pDx11Dev->CreateRenderTargetView(engine.pSSIMTex[eyeIdx], &rtvDesc, &engine.pSSIMTexRtv[eyeIdx]);
+        }
+        if (SUCCEEDED(hr))
+        {
+            hr = pDx11Dev->CreateRenderTargetView(engine.pSSIMTexVariance[eyeIdx], &rtvDesc, &engine.pSSIMTexVarianceRtv[eyeIdx]);
+        }
+        if (SUCCEEDED(hr))
+        {
+            hr = pDx11Dev->CreateShaderResourceView(engine.pSSIMTex[eyeIdx], &srvDesc, &engine.pSSIMTexSrv[eyeIdx]);
+        }
+        if (SUCCEEDED(hr))
+        {
+            hr = pDx11Dev->CreateShaderResourceView(engine.pSSIMTexVariance[eyeIdx], &srvDesc, &engine.pSSIMTexVarianceSrv[eyeIdx]);
+        }
+        if (SUCCEEDED(hr))
+        {
+            hr = AdjustStereoVertexBuffer(vertices, eyeIdx, sType);
+        }
+        if (SUCCEEDED(hr))
+        {
+            ZeroMemory(&BufferDesc, sizeof(BufferDesc));
+            BufferDesc.ByteWidth = sizeof(vertices);
+            BufferDesc.Usage = D3D11_USAGE_DEFAULT;
+            BufferDesc.BindFlags = D3D11_BIND_VERTEX_BUFFER;
+            BufferDesc.CPUAccessFlags = 0;
+            hr = pDx11Dev->CreateBuffer(&BufferDesc, &InitData, &engine.pVB[eyeIdx]);
+        }
         if (SUCCEEDED(hr))
         {
-            pixVal = *((UINT16*)mappedResource.pData);
+            ZeroMemory(&BufferDesc, sizeof(BufferDesc));
+            BufferDesc.ByteWidth = sizeof(CBAverageSingle);
+            BufferDesc.Usage = D3D11_USAGE_DEFAULT;
+            BufferDesc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
+            hr = pDx11Dev->CreateBuffer(&BufferDesc, NULL, &engine.pCBAverageSingle[eyeIdx]);
         }
-        pDevCtx->Unmap(pCaptureTex, idx);
     }
-    SafeRelease(pCaptureTex);
-    return pixVal;
+
+    if (SUCCEEDED(hr))
+    {
+        hr = pDx11Dev->CreateTexture2D(&ssimTexDesc, NULL, &engine.pSSIMTexCovariance);
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = pDx11Dev->CreateRenderTargetView(engine.pSSIMTexCovariance, &rtvDesc, &engine.pSSIMTexCovarianceRtv);
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = pDx11Dev->CreateShaderResourceView(engine.pSSIMTexCovariance, &srvDesc, &engine.pSSIMTexCovarianceSrv);
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = AdjustStereoVertexBuffer(vertices, 0, STEREO_TYPE_2D);
+    }
+    if (SUCCEEDED(hr))
+    {
+        ZeroMemory(&BufferDesc, sizeof(BufferDesc));
+        BufferDesc.ByteWidth = sizeof(vertices);
+        BufferDesc.Usage = D3D11_USAGE_DEFAULT;
+        BufferDesc.BindFlags = D3D11_BIND_VERTEX_BUFFER;
+        BufferDesc.CPUAccessFlags = 0;
+        hr = pDx11Dev->CreateBuffer(&BufferDesc, &InitData, &engine.pVBCovariance);
+    }
+    if (SUCCEEDED(hr))
+    {
+        ZeroMemory(&BufferDesc, sizeof(BufferDesc));
+        BufferDesc.ByteWidth = sizeof(CBAveragePair);
+        BufferDesc.Usage = D3D11_USAGE_DEFAULT;
+        BufferDesc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
+        hr = pDx11Dev->CreateBuffer(&BufferDesc, NULL, &engine.pCBAveragePair);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        D3D11_TEXTURE2D_DESC readbackDesc = ssimTexDesc;
+        readbackDesc.Width = 1;
+        readbackDesc.Height = 1;
+        readbackDesc.MipLevels = 1;
+        readbackDesc.Usage = D3D11_USAGE_STAGING;
+        readbackDesc.BindFlags = 0;
+        readbackDesc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+        readbackDesc.MiscFlags = 0;
+        hr = pDx11Dev->CreateTexture2D(&readbackDesc, NULL, &engine.pReadbackTex);
+    }
+    if (SUCCEEDED(hr))
+    {
+        // Every dumped target shares the covariance texture's layout
+        hr = DebugDumpCreateStagingPool(engine.pSSIMTexCovariance);
+    }
+
+    return hr;
 }
 
-void ValidateStereoFormat(CONST PWCHAR pFileName, UINT32 width, UINT32 height, STEREO_TYPE sType, BOOL &isHighCl, double &ssim)
+HRESULT CreateGpuEngine(GPU_ENGINE &engine, UINT32 width, UINT32 height, STEREO_TYPE sType)
 {
     HRESULT hr = S_OK;
     D3D_DRIVER_TYPE driverType = D3D_DRIVER_TYPE_NULL;
     D3D_FEATURE_LEVEL featureLevel = D3D_FEATURE_LEVEL_11_0;
-    ID3D11Device *pDx11Dev = NULL;
-    ID3D11DeviceContext *pDx11DevCtx = NULL;
-    ID3D11VertexShader *pVSPassThrough = NULL;
-    ID3D11InputLayout *pInputLayout = NULL;
-    ID3D11PixelShader *pPSAverage = NULL;
-    ID3D11PixelShader *pPSVariance = NULL;
-    ID3D11PixelShader *pPSCovariance = NULL;
-    ID3D11Buffer *pIB = NULL;
-    ID3D11SamplerState *pSamplerLinear = NULL;
-    D3D11_VIEWPORT viewport = { 0 };
-    UINT side = 1024;// 2^10
-    viewport.Width = (FLOAT)side;
-    viewport.Height = (FLOAT)side;
-    viewport.MinDepth = 0.0f;
-    viewport.MaxDepth = 1.0f;
-    viewport.TopLeftX = 0;
-    viewport.TopLeftY = 0;
+
+    ZeroMemory(&engine, sizeof(engine));
 
     UINT createDeviceFlags = 0;
 #ifdef _DEBUG
@@ -309,7 +477,7 @@ void ValidateStereoFormat(CONST PWCHAR pFileName, UINT32 width, UINT32 height, S
         {
             driverType = driverTypes[driverTypeIndex];
             hr = D3D11CreateDevice(NULL, driverType, NULL, createDeviceFlags, featureLevels, numFeatureLevels,
-                D3D11_SDK_VERSION, &pDx11Dev, &featureLevel, &pDx11DevCtx);
+                D3D11_SDK_VERSION, &engine.pDx11Dev, &featureLevel, &engine.pDx11DevCtx);
             if (SUCCEEDED(hr))
                 break;
         }
@@ -317,7 +485,7 @@ void ValidateStereoFormat(CONST PWCHAR pFileName, UINT32 width, UINT32 height, S
 
     if (SUCCEEDED(hr))
     {
-        hr = pDx11Dev->CreateVertexShader(g_Passthrough_VS, ARRAYSIZE(g_Passthrough_VS), nullptr, &pVSPassThrough);
+        hr = engine.pDx11Dev->CreateVertexShader(g_Passthrough_VS, ARRAYSIZE(g_Passthrough_VS), nullptr, &engine.pVSPassThrough);
     }
 
     if (SUCCEEDED(hr))
@@ -328,40 +496,34 @@ void ValidateStereoFormat(CONST PWCHAR pFileName, UINT32 width, UINT32 height, S
             { "TEXCOORD", 0, DXGI_FORMAT_R32G32_FLOAT, 0, 12, D3D11_INPUT_PER_VERTEX_DATA, 0 },
         };
         UINT NumElements = ARRAYSIZE(Layout);
-        hr = pDx11Dev->CreateInputLayout(Layout, NumElements, g_Passthrough_VS, ARRAYSIZE(g_Passthrough_VS), &pInputLayout);
+        hr = engine.pDx11Dev->CreateInputLayout(Layout, NumElements, g_Passthrough_VS, ARRAYSIZE(g_Passthrough_VS), &engine.pInputLayout);
     }
 
     if (SUCCEEDED(hr))
     {
-        hr = pDx11Dev->CreatePixelShader(g_Average_PS, ARRAYSIZE(g_Average_PS), nullptr, &pPSAverage);
+        hr = engine.pDx11Dev->CreatePixelShader(g_Average_PS, ARRAYSIZE(g_Average_PS), nullptr, &engine.pPSAverage);
     }
     if (SUCCEEDED(hr))
     {
-        hr = pDx11Dev->CreatePixelShader(g_Variance_PS, ARRAYSIZE(g_Variance_PS), nullptr, &pPSVariance);
+        hr = engine.pDx11Dev->CreatePixelShader(g_Variance_PS, ARRAYSIZE(g_Variance_PS), nullptr, &engine.pPSVariance);
     }
     if (SUCCEEDED(hr))
     {
-        hr = pDx11Dev->CreatePixelShader(g_Covariance_PS, ARRAYSIZE(g_Covariance_PS), nullptr, &pPSCovariance);
+        hr = engine.pDx11Dev->CreatePixelShader(g_Covariance_PS, ARRAYSIZE(g_Covariance_PS), nullptr, &engine.pPSCovariance);
     }
 
-    WORD indices[] =
-    {
-        0, 1, 3,
-        3, 1, 2,
-    };
-
     D3D11_BUFFER_DESC BufferDesc;
     ZeroMemory(&BufferDesc, sizeof(BufferDesc));
-    BufferDesc.ByteWidth = sizeof(WORD) * ARRAYSIZE(indices);
+    BufferDesc.ByteWidth = sizeof(QUAD_INDICES);
     BufferDesc.Usage = D3D11_USAGE_DEFAULT;
     BufferDesc.BindFlags = D3D11_BIND_INDEX_BUFFER;
     BufferDesc.CPUAccessFlags = 0;
     D3D11_SUBRESOURCE_DATA InitData;
     ZeroMemory(&InitData, sizeof(InitData));
-    InitData.pSysMem = indices;
+    InitData.pSysMem = QUAD_INDICES;
     if (SUCCEEDED(hr))
     {
-        hr = pDx11Dev->CreateBuffer(&BufferDesc, &InitData, &pIB);
+        hr = engine.pDx11Dev->CreateBuffer(&BufferDesc, &InitData, &engine.pIB);
     }
 
     if (SUCCEEDED(hr))
@@ -375,367 +537,561 @@ void ValidateStereoFormat(CONST PWCHAR pFileName, UINT32 width, UINT32 height, S
         SampDesc.ComparisonFunc = D3D11_COMPARISON_NEVER;
         SampDesc.MinLOD = 0;
         SampDesc.MaxLOD = D3D11_FLOAT32_MAX;
-        hr = pDx11Dev->CreateSamplerState(&SampDesc, &pSamplerLinear);
+        hr = engine.pDx11Dev->CreateSamplerState(&SampDesc, &engine.pSamplerLinear);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = CreateGpuFrameResources(engine, width, height, sType);
+    }
+
+    if (FAILED(hr))
+    {
+        ReleaseGpuEngine(engine);
     }
 
+    return hr;
+}
+
+HRESULT ComputeStereoStatsGpu(GPU_ENGINE &engine, CONST BYTE *pLuma, UINT64 frameIndex, PAIR_STATS &stats)
+{
+    HRESULT hr = S_OK;
+    ID3D11DeviceContext *pDx11DevCtx = engine.pDx11DevCtx;
+    ID3D11VertexShader *pVSPassThrough = engine.pVSPassThrough;
+    ID3D11InputLayout *pInputLayout = engine.pInputLayout;
+    ID3D11PixelShader *pPSAverage = engine.pPSAverage;
+    ID3D11PixelShader *pPSVariance = engine.pPSVariance;
+    ID3D11PixelShader *pPSCovariance = engine.pPSCovariance;
+    ID3D11Buffer *pIB = engine.pIB;
+    ID3D11SamplerState *pSamplerLinear = engine.pSamplerLinear;
+    D3D11_VIEWPORT viewport = { 0 };
+    UINT side = GPU_TARGET_SIDE;
+    viewport.Width = (FLOAT)side;
+    viewport.Height = (FLOAT)side;
+    viewport.MinDepth = 0.0f;
+    viewport.MaxDepth = 1.0f;
+    viewport.TopLeftX = 0;
+    viewport.TopLeftY = 0;
+
+    // Sample scale is 0-255, mip values are in UNORM 0-1 units
+    UINT32 bitDepth = 8;
+    double sampleScale = 255.0;
+    double besselFactor = (double)side * side / ((double)side * side - 1.0);
+    double average[STEREO_EYE_COUNT] = { 0.0 };
+    double variance[STEREO_EYE_COUNT] = { 0.0 };
+    double covariance = 0.0;
+
+    float ClearColor[4] = { 1.0f, 0.0f, 0.0f, 1.0f };
+    UINT stride = sizeof(VERTEX);
+    UINT offset = 0;
+
+    pDx11DevCtx->UpdateSubresource(engine.pTexYUV, 0, NULL, pLuma, engine.width, 0);
+
+    for (UINT eyeIdx = 0; eyeIdx < STEREO_EYE_COUNT; eyeIdx++)
     {
-        float average[STEREO_EYE_COUNT] = { 0.0f };
-        float stdDeviation[STEREO_EYE_COUNT] = { 0.0f };
-        float covariance = 0.0f;
+        // Now draw Y to the eye texture
+        pDx11DevCtx->ClearRenderTargetView(engine.pSSIMTexRtv[eyeIdx], ClearColor);
+        pDx11DevCtx->OMSetRenderTargets(1, &engine.pSSIMTexRtv[eyeIdx], NULL);
+        pDx11DevCtx->RSSetViewports(1, &viewport);
+        pDx11DevCtx->IASetInputLayout(pInputLayout);
+        pDx11DevCtx->IASetVertexBuffers(0, 1, &engine.pVB[eyeIdx], &stride, &offset);
+        pDx11DevCtx->IASetIndexBuffer(pIB, DXGI_FORMAT_R16_UINT, 0);
+        pDx11DevCtx->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+        pDx11DevCtx->VSSetShader(pVSPassThrough, NULL, 0);
+        pDx11DevCtx->PSSetShader(pPSAverage, NULL, 0);
+        pDx11DevCtx->PSSetSamplers(0, 1, &pSamplerLinear);
+        pDx11DevCtx->PSSetShaderResources(0, 1, &engine.pSrvYUV);
+        pDx11DevCtx->DrawIndexed(ARRAYSIZE(QUAD_INDICES), 0, 0);
+
+        // Generate all mips
+        pDx11DevCtx->GenerateMips(engine.pSSIMTexSrv[eyeIdx]);
+        DebugDumpTexture(pDx11DevCtx, engine.pSSIMTex[eyeIdx], frameIndex, DUMP_STAGE_EYE_PLANE, eyeIdx, bitDepth);
+
+        // Get average
+        average[eyeIdx] = GetMip1Value(pDx11DevCtx, engine.pReadbackTex, engine.pSSIMTex[eyeIdx]) * sampleScale;
+
+        CBAverageSingle cbAverage = { 0 };
+        cbAverage.average = (float)(average[eyeIdx] / sampleScale);
+        pDx11DevCtx->UpdateSubresource(engine.pCBAverageSingle[eyeIdx], 0, NULL, &cbAverage, 0, 0);
 
-        HANDLE hYuvFile = NULL;
-        LARGE_INTEGER fileSize = { 0 };
-        hYuvFile = CreateFile(pFileName, GENERIC_READ, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-        if (hYuvFile)
+        pDx11DevCtx->ClearRenderTargetView(engine.pSSIMTexVarianceRtv[eyeIdx], ClearColor);
+        pDx11DevCtx->OMSetRenderTargets(1, &engine.pSSIMTexVarianceRtv[eyeIdx], NULL);
+        pDx11DevCtx->RSSetViewports(1, &viewport);
+        pDx11DevCtx->IASetInputLayout(pInputLayout);
+        pDx11DevCtx->IASetVertexBuffers(0, 1, &engine.pVB[eyeIdx], &stride, &offset);
+        pDx11DevCtx->IASetIndexBuffer(pIB, DXGI_FORMAT_R16_UINT, 0);
+        pDx11DevCtx->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+        pDx11DevCtx->PSSetConstantBuffers(0, 1, &engine.pCBAverageSingle[eyeIdx]);
+        pDx11DevCtx->VSSetShader(pVSPassThrough, NULL, 0);
+        pDx11DevCtx->PSSetShader(pPSVariance, NULL, 0);
+        pDx11DevCtx->PSSetSamplers(0, 1, &pSamplerLinear);
+        pDx11DevCtx->PSSetShaderResources(0, 1, &engine.pSrvYUV);
+        pDx11DevCtx->DrawIndexed(ARRAYSIZE(QUAD_INDICES), 0, 0);
+
+        // Generate all mips
+        pDx11DevCtx->GenerateMips(engine.pSSIMTexVarianceSrv[eyeIdx]);
+        DebugDumpTexture(pDx11DevCtx, engine.pSSIMTexVariance[eyeIdx], frameIndex, DUMP_STAGE_VARIANCE, eyeIdx, bitDepth);
+
+        // Get variance
+        variance[eyeIdx] = GetMip1Value(pDx11DevCtx, engine.pReadbackTex, engine.pSSIMTexVariance[eyeIdx]) * sampleScale * sampleScale * besselFactor;
+    }
+
+    CBAveragePair cbAveragePair = { 0 };
+    cbAveragePair.average1 = (float)(average[STEREO_EYE_LEFT] / sampleScale);
+    cbAveragePair.average2 = (float)(average[STEREO_EYE_RIGHT] / sampleScale);
+    pDx11DevCtx->UpdateSubresource(engine.pCBAveragePair, 0, NULL, &cbAveragePair, 0, 0);
+
+    pDx11DevCtx->ClearRenderTargetView(engine.pSSIMTexCovarianceRtv, ClearColor);
+    pDx11DevCtx->OMSetRenderTargets(1, &engine.pSSIMTexCovarianceRtv, NULL);
+    pDx11DevCtx->RSSetViewports(1, &viewport);
+    pDx11DevCtx->IASetInputLayout(pInputLayout);
+    pDx11DevCtx->IASetVertexBuffers(0, 1, &engine.pVBCovariance, &stride, &offset);
+    pDx11DevCtx->IASetIndexBuffer(pIB, DXGI_FORMAT_R16_UINT, 0);
+    pDx11DevCtx->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+    pDx11DevCtx->PSSetConstantBuffers(0, 1, &engine.pCBAveragePair);
+    pDx11DevCtx->VSSetShader(pVSPassThrough, NULL, 0);
+    pDx11DevCtx->PSSetShader(pPSCovariance, NULL, 0);
+    pDx11DevCtx->PSSetSamplers(0, 1, &pSamplerLinear);
+    pDx11DevCtx->PSSetShaderResources(STEREO_EYE_LEFT, 1, &engine.pSSIMTexSrv[STEREO_EYE_LEFT]);
+    pDx11DevCtx->PSSetShaderResources(STEREO_EYE_RIGHT, 1, &engine.pSSIMTexSrv[STEREO_EYE_RIGHT]);
+    pDx11DevCtx->DrawIndexed(ARRAYSIZE(QUAD_INDICES), 0, 0);
+
+    pDx11DevCtx->GenerateMips(engine.pSSIMTexCovarianceSrv);
+    DebugDumpTexture(pDx11DevCtx, engine.pSSIMTexCovariance, frameIndex, DUMP_STAGE_COVARIANCE, STEREO_EYE_COUNT, bitDepth);
+    covariance = GetMip1Value(pDx11DevCtx, engine.pReadbackTex, engine.pSSIMTexCovariance) * sampleScale * sampleScale * besselFactor;
+
+    // The next frame binds the eye textures as render targets again
+    ID3D11ShaderResourceView *nullSrv[STEREO_EYE_COUNT] = { NULL, NULL };
+    pDx11DevCtx->PSSetShaderResources(0, STEREO_EYE_COUNT, nullSrv);
+
+    stats.averageX = average[STEREO_EYE_LEFT];
+    stats.averageY = average[STEREO_EYE_RIGHT];
+    stats.varianceX = variance[STEREO_EYE_LEFT];
+    stats.varianceY = variance[STEREO_EYE_RIGHT];
+    stats.covariance = covariance;
+
+    DebugDumpPoll(pDx11DevCtx, FALSE);
+
+    return hr;
+}
+
+inline UINT32 GetEyeCount(STEREO_TYPE sType)
+{
+    return (sType == STEREO_TYPE_2D) ? 1 : STEREO_EYE_COUNT;
+}
+
+// Per-tile means and variances of every eye and the covariance between them,
+// the CPU counterpart of the GPU mip chains
+void DumpTileStats(UINT64 frameIndex, UINT32 bitDepth, UINT32 eyeCount, CONST PLANE_VIEW &plane, CONST std::vector<PAIR_MOMENTS> &tiles)
+{
+    UINT32 columns = 0;
+    UINT32 rows = 0;
+    GetTileGrid(plane.width, plane.height, columns, rows);
+
+    std::vector<PAIR_STATS> tileStats(tiles.size());
+    for (SIZE_T idx = 0; idx < tiles.size(); idx++)
+    {
+        GetMomentStats(tiles[idx], tileStats[idx]);
+    }
+
+    double scale = 1.0 / (double)((1 << bitDepth) - 1);
+    std::vector<FLOAT> values(tiles.size());
+    for (UINT eyeIdx = 0; eyeIdx < eyeCount; eyeIdx++)
+    {
+        for (SIZE_T idx = 0; idx < tiles.size(); idx++)
         {
-            if (!GetFileSizeEx(hYuvFile, &fileSize))
-            {
-                hr = E_INVALIDARG;
-            }
+            values[idx] = (FLOAT)(((eyeIdx == STEREO_EYE_LEFT) ? tileStats[idx].averageX : tileStats[idx].averageY) * scale);
         }
-        else
+        DebugDumpTileGrid(frameIndex, DUMP_STAGE_MEAN, eyeIdx, bitDepth, FRAME_STATS_TILE_WIDTH, FRAME_STATS_TILE_HEIGHT, columns, rows, values.data());
+
+        for (SIZE_T idx = 0; idx < tiles.size(); idx++)
         {
-            hr = E_INVALIDARG;
+            values[idx] = (FLOAT)(((eyeIdx == STEREO_EYE_LEFT) ? tileStats[idx].varianceX : tileStats[idx].varianceY) * scale * scale);
         }
+        DebugDumpTileGrid(frameIndex, DUMP_STAGE_VARIANCE, eyeIdx, bitDepth, FRAME_STATS_TILE_WIDTH, FRAME_STATS_TILE_HEIGHT, columns, rows, values.data());
+    }
 
-        PBYTE pYuvBuf = (PBYTE)malloc(fileSize.LowPart);
-        DWORD bytesRead = 0;
-        if (SUCCEEDED(hr))
+    for (SIZE_T idx = 0; idx < tiles.size(); idx++)
+    {
+        values[idx] = (FLOAT)(tileStats[idx].covariance * scale * scale);
+    }
+    DebugDumpTileGrid(frameIndex, DUMP_STAGE_COVARIANCE, STEREO_EYE_COUNT, bitDepth, FRAME_STATS_TILE_WIDTH, FRAME_STATS_TILE_HEIGHT, columns, rows, values.data());
+}
+
+// pHistory is optional, it makes unchanged tiles come from the previous frame
+HRESULT ComputeStereoStatsCpu(CONST BYTE *pLuma, CONST FRAME_SOURCE &source, STEREO_TYPE sType, UINT64 frameIndex, UINT32 threadCount, PFRAME_HISTORY pHistory, PAIR_STATS &stats)
+{
+    HRESULT hr = S_OK;
+    PLANE_VIEW eyeViews[STEREO_EYE_COUNT];
+    PPAIR_STATS_CACHE pCache = NULL;
+    // Both views of 2D are the whole frame, one history or dump covers them
+    UINT32 eyeCount = GetEyeCount(sType);
+    BOOL isSampled = DebugDumpIsSampled(frameIndex);
+    std::vector<PAIR_MOMENTS> tiles;
+
+    hr = GetStereoEyeViews(pLuma, source.width, source.height, GetLumaPitch(source), source.bytesPerSample, sType, eyeViews);
+    if (SUCCEEDED(hr) && isSampled)
+    {
+        DXGI_FORMAT format = (source.bytesPerSample == 1) ? DXGI_FORMAT_R8_UNORM : DXGI_FORMAT_R16_UNORM;
+        for (UINT eyeIdx = 0; eyeIdx < eyeCount; eyeIdx++)
         {
-            if (!ReadFile(hYuvFile, pYuvBuf, fileSize.LowPart, &bytesRead, NULL))
-            {
-                hr = E_INVALIDARG;
-            }
-            else if (fileSize.LowPart != bytesRead)
-            {
-                hr = E_FAIL;
-            }
+            DebugDumpPlane(frameIndex, DUMP_STAGE_EYE_PLANE, eyeIdx, 0, format, source.bitDepth,
+                eyeViews[eyeIdx].width, eyeViews[eyeIdx].height, source.bytesPerSample, eyeViews[eyeIdx].pData, eyeViews[eyeIdx].pitch);
         }
-        SafeCloseHandle(hYuvFile);
-
-        ID3D11Texture2D *pTexYUV = NULL;
-        ID3D11ShaderResourceView *pSrvYUV = NULL;
-        D3D11_TEXTURE2D_DESC texYUVDesc = { 0 };
-        texYUVDesc.Width = width;
-        texYUVDesc.Height = height;
-        texYUVDesc.MipLevels = 1;
-        texYUVDesc.ArraySize = 1;
-        texYUVDesc.Format = DXGI_FORMAT_NV12;
-        texYUVDesc.SampleDesc.Count = 1;
-        texYUVDesc.SampleDesc.Quality = 0;
-        texYUVDesc.Usage = D3D11_USAGE_DEFAULT;
-        texYUVDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
-        texYUVDesc.CPUAccessFlags = 0;
-        texYUVDesc.MiscFlags = 0;
-
-        D3D11_SUBRESOURCE_DATA initData = { 0 };
-        RtlZeroMemory(&initData, sizeof(initData));
-        initData.pSysMem = pYuvBuf;
-        initData.SysMemPitch = texYUVDesc.Width;
-        initData.SysMemSlicePitch = 0;
-        if (SUCCEEDED(hr))
+    }
+    if (SUCCEEDED(hr) && pHistory)
+    {
+        for (UINT eyeIdx = 0; SUCCEEDED(hr) && (eyeIdx < eyeCount); eyeIdx++)
         {
-            hr = pDx11Dev->CreateTexture2D(&texYUVDesc, &initData, &pTexYUV);
+            hr = UpdatePlaneHistory(eyeViews[eyeIdx], threadCount, pHistory->eyes[eyeIdx]);
         }
+        pCache = &pHistory->stereoCache;
+        pCache->pHistoryX = &pHistory->eyes[STEREO_EYE_LEFT];
+        pCache->pHistoryY = &pHistory->eyes[eyeCount - 1];
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = ComputePairStats(eyeViews[STEREO_EYE_LEFT], eyeViews[STEREO_EYE_RIGHT], threadCount, pCache, isSampled ? &tiles : NULL, stats);
+    }
+    if (SUCCEEDED(hr) && isSampled)
+    {
+        DumpTileStats(frameIndex, source.bitDepth, eyeCount, eyeViews[STEREO_EYE_LEFT], tiles);
+    }
+
+    return hr;
+}
 
-        D3D11_SHADER_RESOURCE_VIEW_DESC srvYUVDesc = { DXGI_FORMAT_UNKNOWN, D3D_SRV_DIMENSION_UNKNOWN,{ 0 } };
-        srvYUVDesc.Format = DXGI_FORMAT_R8_UNORM;
-        srvYUVDesc.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE2D;
-        srvYUVDesc.Texture2D.MostDetailedMip = 0;
-        srvYUVDesc.Texture2D.MipLevels = texYUVDesc.MipLevels;
+// Each eye of the distorted frame against the same eye of the reference.
+// With pHistory, ComputeStereoStatsCpu has already updated the distorted
+// eyes for this frame and only the reference eyes are compared here.
+HRESULT ComputeReferenceStatsCpu(CONST BYTE *pRefLuma, CONST BYTE *pLuma, CONST FRAME_SOURCE &source, STEREO_TYPE sType, UINT32 threadCount,
+    PFRAME_HISTORY pHistory, PAIR_STATS stats[STEREO_EYE_COUNT])
+{
+    HRESULT hr = S_OK;
+    PLANE_VIEW refViews[STEREO_EYE_COUNT];
+    PLANE_VIEW eyeViews[STEREO_EYE_COUNT];
+
+    hr = GetStereoEyeViews(pRefLuma, source.width, source.height, GetLumaPitch(source), source.bytesPerSample, sType, refViews);
+    if (SUCCEEDED(hr))
+    {
+        hr = GetStereoEyeViews(pLuma, source.width, source.height, GetLumaPitch(source), source.bytesPerSample, sType, eyeViews);
+    }
+    for (UINT eyeIdx = 0; SUCCEEDED(hr) && (eyeIdx < GetEyeCount(sType)); eyeIdx++)
+    {
+        PPAIR_STATS_CACHE pCache = NULL;
+        if (pHistory)
+        {
+            hr = UpdatePlaneHistory(refViews[eyeIdx], threadCount, pHistory->refEyes[eyeIdx]);
+            pCache = &pHistory->refCaches[eyeIdx];
+            pCache->pHistoryX = &pHistory->refEyes[eyeIdx];
+            pCache->pHistoryY = &pHistory->eyes[eyeIdx];
+        }
         if (SUCCEEDED(hr))
         {
-            hr = pDx11Dev->CreateShaderResourceView(pTexYUV, &srvYUVDesc, &pSrvYUV);
+            hr = ComputePairStats(refViews[eyeIdx], eyeViews[eyeIdx], threadCount, pCache, NULL, stats[eyeIdx]);
         }
+    }
+
+    return hr;
+}
 
-        VERTEX vertices[] =
+UINT64 GetTilesReused(CONST FRAME_HISTORY &history)
+{
+    return history.stereoCache.tilesReused + history.refCaches[STEREO_EYE_LEFT].tilesReused + history.refCaches[STEREO_EYE_RIGHT].tilesReused;
+}
+
+UINT64 GetTilesComputed(CONST FRAME_HISTORY &history)
+{
+    return history.stereoCache.tilesComputed + history.refCaches[STEREO_EYE_LEFT].tilesComputed + history.refCaches[STEREO_EYE_RIGHT].tilesComputed;
+}
+
+HRESULT ProcessFrameRange(FRAME_WORKER &worker)
+{
+    HRESULT hr = S_OK;
+    CONST SSIM_OPTIONS &options = *worker.pOptions;
+    FRAME_SOURCE source = { 0 };
+    GPU_ENGINE engine = { 0 };
+    FRAME_HISTORY history = { 0 };
+    PBYTE pLuma = NULL;
+    FRAME_SOURCE refSource = { 0 };
+    PBYTE pRefLuma = NULL;
+
+    // Every worker reads through its own handle
+    hr = CloneFrameSource(options.pFileName, *worker.pSource, source);
+    if (SUCCEEDED(hr))
+    {
+        pLuma = (PBYTE)malloc((SIZE_T)GetLumaPitch(source) * source.height);
+        if (pLuma == NULL)
         {
-            { XMFLOAT3(-1.0f, -1.0f, 0.0f), XMFLOAT2(0.0f, 1.0f) },
-            { XMFLOAT3(-1.0f, 1.0f, 0.0f), XMFLOAT2(0.0f, 0.0f) },
-            { XMFLOAT3(1.0f, 1.0f, 0.0f), XMFLOAT2(1.0f, 0.0f) },
-            { XMFLOAT3(1.0f, -1.0f, 0.0f), XMFLOAT2(1.0f, 1.0f) },
-        };
-        float ClearColor[4] = { 1.0f, 0.0f, 0.0f, 1.0f };
-        UINT stride = sizeof(VERTEX);
-        UINT offset = 0;
-        D3D11_SUBRESOURCE_DATA InitData;
-        ZeroMemory(&InitData, sizeof(InitData));
-        InitData.pSysMem = vertices;
-
-        D3D11_TEXTURE2D_DESC ssimTexDesc = { 0 };
-        D3D11_RENDER_TARGET_VIEW_DESC rtvDesc = { DXGI_FORMAT_UNKNOWN, D3D11_RTV_DIMENSION_UNKNOWN,{ 0 } };
-        D3D11_SHADER_RESOURCE_VIEW_DESC srvDesc = { DXGI_FORMAT_UNKNOWN, D3D_SRV_DIMENSION_UNKNOWN,{ 0 } };
-        ID3D11Texture2D *pSSIMTex[STEREO_EYE_COUNT] = { NULL, NULL };
-        ID3D11RenderTargetView *pSSIMTexRtv[STEREO_EYE_COUNT] = { NULL, NULL };
-        ID3D11ShaderResourceView *pSSIMTexSrv[STEREO_EYE_COUNT] = { NULL, NULL };
-        ID3D11Texture2D *pSSIMTexVariance[STEREO_EYE_COUNT] = { NULL, NULL };
-        ID3D11RenderTargetView *pSSIMTexVarianceRtv[STEREO_EYE_COUNT] = { NULL, NULL };
-        ID3D11ShaderResourceView *pSSIMTexVarianceSrv[STEREO_EYE_COUNT] = { NULL, NULL };
-        ID3D11Buffer *pVB[STEREO_EYE_COUNT] = { NULL, NULL };
-        ID3D11Buffer *pCBAverageSingle[STEREO_EYE_COUNT] = { NULL, NULL };
-        ID3D11Buffer *pCBAveragePair = NULL;
-        ID3D11Texture2D *pSSIMTexCovariance = NULL;
-        ID3D11RenderTargetView *pSSIMTexCovarianceRtv = NULL;
-        ID3D11ShaderResourceView *pSSIMTexCovarianceSrv = NULL;
-        ID3D11Buffer *pVBCovariance = NULL;
+            hr = E_OUTOFMEMORY;
+        }
+    }
+    if (SUCCEEDED(hr) && worker.pRefSource)
+    {
+        hr = CloneFrameSource(options.pRefFileName, *worker.pRefSource, refSource);
         if (SUCCEEDED(hr))
         {
-            RtlCopyMemory(&ssimTexDesc, &texYUVDesc, sizeof(texYUVDesc));
-            //ssimTexDesc.Format = DXGI_FORMAT_R8_UNORM;
-            ssimTexDesc.Format = DXGI_FORMAT_R16_UNORM;// To reduce accuracy lost during calculation
-            ssimTexDesc.Width = side;
-            ssimTexDesc.Height = side;
-            ssimTexDesc.BindFlags = D3D11_BIND_RENDER_TARGET | D3D11_BIND_SHADER_RESOURCE;
-            ssimTexDesc.MiscFlags = D3D11_RESOURCE_MISC_GENERATE_MIPS;
-            ssimTexDesc.MipLevels = 0;
-
-            rtvDesc.Format = ssimTexDesc.Format;
-            rtvDesc.ViewDimension = D3D11_RTV_DIMENSION_TEXTURE2D;
-            rtvDesc.Texture2DArray.MipSlice = 0;
-
-            srvDesc.Format = ssimTexDesc.Format;
-            srvDesc.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE2D;
-            srvDesc.Texture2D.MostDetailedMip = 0;
-            srvDesc.Texture2D.MipLevels = -1;
-
-            for (UINT eyeIdx = 0; eyeIdx < STEREO_EYE_COUNT; eyeIdx++)
+            pRefLuma = (PBYTE)malloc((SIZE_T)GetLumaPitch(refSource) * refSource.height);
+            if (pRefLuma == NULL)
             {
-                // Prepare resources
-                hr = pDx11Dev->CreateTexture2D(&ssimTexDesc, NULL, &pSSIMTex[eyeIdx]);
-                if (FAILED(hr))
-                {
-                    break;
-                }
-                hr = pDx11Dev->CreateTexture2D(&ssimTexDesc, NULL, &pSSIMTexVariance[eyeIdx]);
-                if (FAILED(hr))
-                {
-                    break;
-                }
-                hr = pDx11Dev->CreateRenderTargetView(pSSIMTex[eyeIdx], &rtvDesc, &pSSIMTexRtv[eyeIdx]);
-                if (FAILED(hr))
-                {
-                    break;
-                }
-                hr = pDx11Dev->CreateRenderTargetView(pSSIMTexVariance[eyeIdx], &rtvDesc, &pSSIMTexVarianceRtv[eyeIdx]);
-                if (FAILED(hr))
-                {
-                    break;
-                }
-                hr = pDx11Dev->CreateShaderResourceView(pSSIMTex[eyeIdx], &srvDesc, &pSSIMTexSrv[eyeIdx]);
-                if (FAILED(hr))
-                {
-                    break;
-                }
-                hr = pDx11Dev->CreateShaderResourceView(pSSIMTexVariance[eyeIdx], &srvDesc, &pSSIMTexVarianceSrv[eyeIdx]);
-                if (FAILED(hr))
-                {
-                    break;
-                }
+                hr = E_OUTOFMEMORY;
+            }
+        }
+    }
+    if (SUCCEEDED(hr) && !options.useCpu)
+    {
+        // The GPU passes sample the luma as R8_UNORM
+        hr = (source.bitDepth == 8) ? CreateGpuEngine(engine, source.width, source.height, options.sType) : E_NOTIMPL;
+    }
 
-                hr = AdjustStereoVertexBuffer(vertices, eyeIdx, sType);
-                if (FAILED(hr))
+    double L = SUCCEEDED(hr) ? (double)((1 << source.bitDepth) - 1) : 0.0;
+    for (UINT64 frameIdx = worker.frameStart; frameIdx < worker.frameEnd; frameIdx++)
+    {
+        FRAME_RESULT &result = worker.pResults[frameIdx - worker.frameStart];
+        PAIR_STATS stats = { 0 };
+        PAIR_STATS refStats[STEREO_EYE_COUNT] = { 0 };
+        LONGLONG frameTime = MetricsNow();
+        LONGLONG stageTime = frameTime;
+
+        result.hr = hr;
+        if (SUCCEEDED(result.hr))
+        {
+            result.hr = ReadFrameLuma(source, frameIdx, pLuma);
+            if (SUCCEEDED(result.hr) && pRefLuma)
+            {
+                result.hr = ReadFrameLuma(refSource, frameIdx, pRefLuma);
+            }
+            MetricsObserveSince(METRIC_HISTOGRAM_READ, stageTime);
+        }
+        if (SUCCEEDED(result.hr))
+        {
+            if (options.useCpu)
+            {
+                // Frames of a shard are consecutive, so the caches stay useful
+                UINT64 tilesReused = GetTilesReused(history);
+                UINT64 tilesComputed = GetTilesComputed(history);
+                stageTime = MetricsNow();
+                result.hr = ComputeStereoStatsCpu(pLuma, source, options.sType, frameIdx, options.threadCount,
+                    options.isIncremental ? &history : NULL, stats);
+                MetricsObserveSince(METRIC_HISTOGRAM_STEREO, stageTime);
+                if (SUCCEEDED(result.hr) && pRefLuma)
                 {
-                    break;
+                    stageTime = MetricsNow();
+                    result.hr = ComputeReferenceStatsCpu(pRefLuma, pLuma, source, options.sType, options.threadCount,
+                        options.isIncremental ? &history : NULL, refStats);
+                    MetricsObserveSince(METRIC_HISTOGRAM_REFERENCE, stageTime);
                 }
+                result.tilesReused = GetTilesReused(history) - tilesReused;
+                result.tilesComputed = GetTilesComputed(history) - tilesComputed;
+            }
+            else
+            {
+                stageTime = MetricsNow();
+                result.hr = ComputeStereoStatsGpu(engine, pLuma, frameIdx, stats);
+                MetricsObserveSince(METRIC_HISTOGRAM_STEREO, stageTime);
+            }
+        }
+        result.ssim = SUCCEEDED(result.hr) ? CalculateSSIM(stats, L) : 0.0;
+        result.refSsimCombined = 0.0;
+        for (UINT eyeIdx = 0; eyeIdx < STEREO_EYE_COUNT; eyeIdx++)
+        {
+            // 2D has a single view, reported for both eyes
+            UINT refEyeIdx = min(eyeIdx, GetEyeCount(options.sType) - 1);
+            result.refSsim[eyeIdx] = (SUCCEEDED(result.hr) && pRefLuma) ? CalculateSSIM(refStats[refEyeIdx], L) : 0.0;
+            result.refSsimCombined += result.refSsim[eyeIdx] / STEREO_EYE_COUNT;
+        }
 
-                ZeroMemory(&BufferDesc, sizeof(BufferDesc));
-                BufferDesc.ByteWidth = sizeof(VERTEX) * ARRAYSIZE(vertices);
-                BufferDesc.Usage = D3D11_USAGE_DEFAULT;
-                BufferDesc.BindFlags = D3D11_BIND_VERTEX_BUFFER;
-                BufferDesc.CPUAccessFlags = 0;
-                hr = pDx11Dev->CreateBuffer(&BufferDesc, &InitData, &pVB[eyeIdx]);
-                if (FAILED(hr))
-                {
-                    break;
-                }
+        MetricsAdd(METRIC_COUNTER_FRAMES, 1);
+        if (FAILED(result.hr))
+        {
+            MetricsAdd(METRIC_COUNTER_FRAMES_ERROR, 1);
+        }
+        else
+        {
+            MetricsAdd((result.ssim >= SSIM_PASS_THRESHOLD) ? METRIC_COUNTER_FRAMES_PASS : METRIC_COUNTER_FRAMES_FAIL, 1);
+        }
+        MetricsAdd(METRIC_COUNTER_TILES_REUSED, result.tilesReused);
+        MetricsAdd(METRIC_COUNTER_TILES_COMPUTED, result.tilesComputed);
+        MetricsObserveSince(METRIC_HISTOGRAM_FRAME, frameTime);
+    }
 
-                // Now draw NV12 to Y only
-                pDx11DevCtx->ClearRenderTargetView(pSSIMTexRtv[eyeIdx], ClearColor);
-                pDx11DevCtx->OMSetRenderTargets(1, &pSSIMTexRtv[eyeIdx], NULL);
-                pDx11DevCtx->RSSetViewports(1, &viewport);
-                pDx11DevCtx->IASetInputLayout(pInputLayout);
-                pDx11DevCtx->IASetVertexBuffers(0, 1, &pVB[eyeIdx], &stride, &offset);
-                pDx11DevCtx->IASetIndexBuffer(pIB, DXGI_FORMAT_R16_UINT, 0);
-                pDx11DevCtx->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
-                pDx11DevCtx->VSSetShader(pVSPassThrough, NULL, 0);
-                pDx11DevCtx->PSSetShader(pPSAverage, NULL, 0);
-                pDx11DevCtx->PSSetSamplers(0, 1, &pSamplerLinear);
-                pDx11DevCtx->PSSetShaderResources(0, 1, &pSrvYUV);
-                pDx11DevCtx->DrawIndexed(ARRAYSIZE(indices), 0, 0);
-
-                // Generate all mips
-                pDx11DevCtx->GenerateMips(pSSIMTexSrv[eyeIdx]);
-                //ProcessCapture(pDx11Dev, pDx11DevCtx, pSSIMTex[eyeIdx]);
-
-                // Get average
-                average[eyeIdx] = (float)GetMip1Value(pDx11Dev, pDx11DevCtx, pSSIMTex[eyeIdx]) / 65535.0f * 255.0f;
-
-                ZeroMemory(&BufferDesc, sizeof(BufferDesc));
-                BufferDesc.ByteWidth = sizeof(CBAverageSingle);
-                BufferDesc.Usage = D3D11_USAGE_DEFAULT;
-                BufferDesc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
-                hr = pDx11Dev->CreateBuffer(&BufferDesc, NULL, &pCBAverageSingle[eyeIdx]);
-                if (FAILED(hr))
-                {
-                    break;
-                }
+    ReleaseGpuEngine(engine);
+    SafeFree(pRefLuma);
+    CloseFrameSource(refSource);
+    SafeFree(pLuma);
+    CloseFrameSource(source);
 
-                CBAverageSingle cbAverage = { 0 };
-                cbAverage.average = average[eyeIdx] / 255.0f;
-                pDx11DevCtx->UpdateSubresource(pCBAverageSingle[eyeIdx], 0, NULL, &cbAverage, 0, 0);
-
-                pDx11DevCtx->ClearRenderTargetView(pSSIMTexVarianceRtv[eyeIdx], ClearColor);
-                pDx11DevCtx->OMSetRenderTargets(1, &pSSIMTexVarianceRtv[eyeIdx], NULL);
-                pDx11DevCtx->RSSetViewports(1, &viewport);
-                pDx11DevCtx->IASetInputLayout(pInputLayout);
-                pDx11DevCtx->IASetVertexBuffers(0, 1, &pVB[eyeIdx], &stride, &offset);
-                pDx11DevCtx->IASetIndexBuffer(pIB, DXGI_FORMAT_R16_UINT, 0);
-                pDx11DevCtx->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
-                pDx11DevCtx->PSSetConstantBuffers(0, 1, &pCBAverageSingle[eyeIdx]);
-                pDx11DevCtx->VSSetShader(pVSPassThrough, NULL, 0);
-                pDx11DevCtx->PSSetShader(pPSVariance, NULL, 0);
-                pDx11DevCtx->PSSetSamplers(0, 1, &pSamplerLinear);
-                pDx11DevCtx->PSSetShaderResources(0, 1, &pSrvYUV);
-                pDx11DevCtx->DrawIndexed(ARRAYSIZE(indices), 0, 0);
-
-                // Generate all mips
-                pDx11DevCtx->GenerateMips(pSSIMTexVarianceSrv[eyeIdx]);
-                //ProcessCapture(pDx11Dev, pDx11DevCtx, pSSIMTexVariance[eyeIdx]);
-
-                // Get standard deviation
-                stdDeviation[eyeIdx] = sqrt(GetMip1Value(pDx11Dev, pDx11DevCtx, pSSIMTexVariance[eyeIdx]) * (float)side * (float)side / ((float)side * (float)side - 1.0f));
-            }
-        }
+    worker.hr = hr;
+    return hr;
+}
 
-        if (SUCCEEDED(hr))
+DWORD WINAPI FrameWorkerThread(LPVOID pParam)
+{
+    return SUCCEEDED(ProcessFrameRange(*(PFRAME_WORKER)pParam)) ? 0 : 1;
+}
+
+HRESULT ValidateStereoFormat(SSIM_OPTIONS &options, std::vector<FRAME_RESULT> &results)
+{
+    HRESULT hr = S_OK;
+    FRAME_SOURCE source = { 0 };
+    FRAME_SOURCE refSource = { 0 };
+
+    // Opened and indexed once here, the workers clone these instead of
+    // rescanning a .y4m whose index could not be saved
+    hr = OpenFrameSource(options.pFileName, options.width, options.height, source);
+    if (SUCCEEDED(hr))
+    {
+        printf("Input: %ux%u, %u-bit, %llu frames", source.width, source.height, source.bitDepth, GetFrameCount(source));
+        if ((source.fpsNum > 0) && (source.fpsDen > 0))
         {
-            hr = pDx11Dev->CreateTexture2D(&ssimTexDesc, NULL, &pSSIMTexCovariance);
+            // Only a .y4m header carries the frame rate
+            printf(", %u/%u fps", source.fpsNum, source.fpsDen);
         }
-        if (SUCCEEDED(hr))
+        printf("\n");
+        if (!options.useCpu && (source.bitDepth != 8))
         {
-            hr = pDx11Dev->CreateRenderTargetView(pSSIMTexCovariance, &rtvDesc, &pSSIMTexCovarianceRtv);
+            printf("The GPU engine only handles 8-bit input!\n");
+            hr = E_NOTIMPL;
         }
+    }
+    if (SUCCEEDED(hr) && options.pRefFileName)
+    {
+        // A raw reference takes its size from the input, which may be a .y4m
+        hr = OpenFrameSource(options.pRefFileName, source.width, source.height, refSource);
         if (SUCCEEDED(hr))
         {
-            hr = pDx11Dev->CreateShaderResourceView(pSSIMTexCovariance, &srvDesc, &pSSIMTexCovarianceSrv);
+            printf("Reference: %ux%u, %u-bit, %llu frames\n", refSource.width, refSource.height, refSource.bitDepth, GetFrameCount(refSource));
+            if ((refSource.width != source.width) || (refSource.height != source.height) ||
+                (refSource.bitDepth != source.bitDepth) || (refSource.bytesPerSample != source.bytesPerSample))
+            {
+                printf("Reference and input have different luma layouts!\n");
+                hr = E_INVALIDARG;
+            }
         }
-        if (SUCCEEDED(hr))
+    }
+    if (SUCCEEDED(hr))
+    {
+        // Both files are walked in lockstep up to the shorter one
+        UINT64 totalFrames = GetFrameCount(source);
+        if (options.pRefFileName)
         {
-            hr = AdjustStereoVertexBuffer(vertices, 0, STEREO_TYPE_2D);
+            totalFrames = min(totalFrames, GetFrameCount(refSource));
         }
-
-        ZeroMemory(&BufferDesc, sizeof(BufferDesc));
-        BufferDesc.ByteWidth = sizeof(VERTEX) * ARRAYSIZE(vertices);
-        BufferDesc.Usage = D3D11_USAGE_DEFAULT;
-        BufferDesc.BindFlags = D3D11_BIND_VERTEX_BUFFER;
-        BufferDesc.CPUAccessFlags = 0;
-        if (SUCCEEDED(hr))
+        if (options.frameStart >= totalFrames)
         {
-            hr = pDx11Dev->CreateBuffer(&BufferDesc, &InitData, &pVBCovariance);
+            hr = E_INVALIDARG;
         }
-
-        ZeroMemory(&BufferDesc, sizeof(BufferDesc));
-        BufferDesc.ByteWidth = sizeof(CBAveragePair);
-        BufferDesc.Usage = D3D11_USAGE_DEFAULT;
-        BufferDesc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
-        if (SUCCEEDED(hr))
+        else if ((options.frameCount == 0) || (options.frameCount > totalFrames - options.frameStart))
         {
-            hr = pDx11Dev->CreateBuffer(&BufferDesc, NULL, &pCBAveragePair);
+            options.frameCount = totalFrames - options.frameStart;
         }
+    }
 
-        CBAveragePair cbAveragePair = { 0 };
-        cbAveragePair.average1 = average[STEREO_EYE_LEFT] / 255.0f;
-        cbAveragePair.average2 = average[STEREO_EYE_RIGHT] / 255.0f;
-        pDx11DevCtx->UpdateSubresource(pCBAveragePair, 0, NULL, &cbAveragePair, 0, 0);
+    UINT32 workerCount = 1;
+    if (SUCCEEDED(hr))
+    {
+        FRAME_RESULT pending = { E_PENDING, 0.0, { 0.0, 0.0 }, 0.0, 0, 0 };
+        results.assign((SIZE_T)options.frameCount, pending);
 
-        pDx11DevCtx->ClearRenderTargetView(pSSIMTexCovarianceRtv, ClearColor);
-        pDx11DevCtx->OMSetRenderTargets(1, &pSSIMTexCovarianceRtv, NULL);
-        pDx11DevCtx->RSSetViewports(1, &viewport);
-        pDx11DevCtx->IASetInputLayout(pInputLayout);
-        pDx11DevCtx->IASetVertexBuffers(0, 1, &pVBCovariance, &stride, &offset);
-        pDx11DevCtx->IASetIndexBuffer(pIB, DXGI_FORMAT_R16_UINT, 0);
-        pDx11DevCtx->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
-        pDx11DevCtx->PSSetConstantBuffers(0, 1, &pCBAveragePair);
-        pDx11DevCtx->VSSetShader(pVSPassThrough, NULL, 0);
-        pDx11DevCtx->PSSetShader(pPSCovariance, NULL, 0);
-        pDx11DevCtx->PSSetSamplers(0, 1, &pSamplerLinear);
-        pDx11DevCtx->PSSetShaderResources(STEREO_EYE_LEFT, 1, &pSSIMTexSrv[STEREO_EYE_LEFT]);
-        pDx11DevCtx->PSSetShaderResources(STEREO_EYE_RIGHT, 1, &pSSIMTexSrv[STEREO_EYE_RIGHT]);
-        pDx11DevCtx->DrawIndexed(ARRAYSIZE(indices), 0, 0);
-
-        pDx11DevCtx->GenerateMips(pSSIMTexCovarianceSrv);
-        //ProcessCapture(pDx11Dev, pDx11DevCtx, pSSIMTexCovariance);
-        covariance = GetMip1Value(pDx11Dev, pDx11DevCtx, pSSIMTexCovariance) * (float)side * (float)side / ((float)side * (float)side - 1.0f);
-
-        // Calculate SSIM
-        float k1 = 0.01f;
-        float k2 = 0.03f;
-        float L = 255.0f;
-        float c1 = pow((k1*L), 2.0f);
-        float c2 = pow((k2*L), 2.0f);
-        float c3 = c2 / 2;
-        double ssimNumerator = (2 * average[STEREO_EYE_LEFT] * average[STEREO_EYE_RIGHT] + c1) * (2 * covariance + c2);
-        double ssimDenominator = (pow(average[STEREO_EYE_LEFT], 2.0f) + pow(average[STEREO_EYE_RIGHT], 2.0f) + c1) * (pow(stdDeviation[STEREO_EYE_LEFT], 2.0f) + pow(stdDeviation[STEREO_EYE_RIGHT], 2.0f) + c2);
-        ssim = ssimNumerator / ssimDenominator;
-
-        // Cleanup
-        for (UINT eyeIdx = 0; eyeIdx < STEREO_EYE_COUNT; eyeIdx++)
+        // More than one worker is CPU only, wmain rejects it with -gpu
+        workerCount = (UINT32)min((UINT64)options.workerCount, options.frameCount);
+        workerCount = max(min(workerCount, (UINT32)MAXIMUM_WAIT_OBJECTS), 1U);
+        if ((workerCount > 1) && (options.threadCount == 0))
         {
-            SafeRelease(pCBAverageSingle[eyeIdx]);
-            SafeRelease(pVB[eyeIdx]);
-            SafeRelease(pSSIMTexVarianceSrv[eyeIdx]);
-            SafeRelease(pSSIMTexVarianceRtv[eyeIdx]);
-            SafeRelease(pSSIMTexVariance[eyeIdx]);
-            SafeRelease(pSSIMTexSrv[eyeIdx]);
-            SafeRelease(pSSIMTexRtv[eyeIdx]);
-            SafeRelease(pSSIMTex[eyeIdx]);
-        }
-        SafeRelease(pVBCovariance);
-        SafeRelease(pSSIMTexCovarianceSrv);
-        SafeRelease(pSSIMTexCovarianceRtv);
-        SafeRelease(pSSIMTexCovariance);
-        SafeRelease(pCBAveragePair);
-        SafeRelease(pSrvYUV);
-        SafeRelease(pTexYUV);
-        SafeFree(pYuvBuf);
-    }
-    SafeRelease(pVSPassThrough);
-    SafeRelease(pInputLayout);
-    SafeRelease(pPSCovariance);
-    SafeRelease(pPSVariance);
-    SafeRelease(pPSAverage);
-    SafeRelease(pIB);
-    SafeRelease(pSamplerLinear);
-    SafeRelease(pDx11DevCtx);
-    SafeRelease(pDx11Dev);
-
-    // All frame should has SSIM no less than 0.8, given specificy stereo type
-    if (ssim < 0.8)
-    {
-        isHighCl = FALSE;
+            SYSTEM_INFO sysInfo = { 0 };
+            GetSystemInfo(&sysInfo);
+            options.threadCount = max(sysInfo.dwNumberOfProcessors / workerCount, 1UL);
+        }
     }
-    else
+
+    if (SUCCEEDED(hr))
     {
-        isHighCl = TRUE;
+        // Contiguous shards, each result lands at its frame position so the
+        // output stays in frame order
+        std::vector<FRAME_WORKER> workers(workerCount);
+        std::vector<HANDLE> threads;
+        for (UINT32 workerIdx = 0; workerIdx < workerCount; workerIdx++)
+        {
+            UINT64 shardStart = options.frameCount * workerIdx / workerCount;
+            UINT64 shardEnd = options.frameCount * (workerIdx + 1) / workerCount;
+            workers[workerIdx].pOptions = &options;
+            workers[workerIdx].pSource = &source;
+            workers[workerIdx].pRefSource = options.pRefFileName ? &refSource : NULL;
+            workers[workerIdx].frameStart = options.frameStart + shardStart;
+            workers[workerIdx].frameEnd = options.frameStart + shardEnd;
+            workers[workerIdx].pResults = results.data() + shardStart;
+            workers[workerIdx].hr = S_OK;
+        }
+
+        if (workerCount == 1)
+        {
+            hr = ProcessFrameRange(workers[0]);
+        }
+        else
+        {
+            for (UINT32 workerIdx = 0; workerIdx < workerCount; workerIdx++)
+            {
+                HANDLE hThread = CreateThread(NULL, 0, FrameWorkerThread, &workers[workerIdx], 0, NULL);
+                if (hThread == NULL)
+                {
+                    // Run the shard here rather than leave a hole in the results
+                    ProcessFrameRange(workers[workerIdx]);
+                }
+                else
+                {
+                    threads.push_back(hThread);
+                }
+            }
+            if (!threads.empty())
+            {
+                WaitForMultipleObjects((DWORD)threads.size(), threads.data(), TRUE, INFINITE);
+            }
+            for (SIZE_T idx = 0; idx < threads.size(); idx++)
+            {
+                SafeCloseHandle(threads[idx]);
+            }
+            for (UINT32 workerIdx = 0; SUCCEEDED(hr) && (workerIdx < workerCount); workerIdx++)
+            {
+                hr = workers[workerIdx].hr;
+            }
+        }
     }
+
+    CloseFrameSource(refSource);
+    CloseFrameSource(source);
+
+    return hr;
 }
 
 void ShowHelp()
 {
     printf("******************************************************\n");
     printf("Usage:\n");
-    printf("ssim_shader <filename> <width> <height> <stereo_type>\n");
+    printf("ssim_shader <filename> <width> <height> <stereo_type> [options]\n");
+    printf("ssim_shader <filename.y4m> <stereo_type> [options]\n");
     printf("\nStereo Type :\n");
     for (UINT idx = 0; idx < ARRAYSIZE(STEREO_TYPE_NAME); idx++)
     {
         printf("  %d: %s\n", idx, STEREO_TYPE_NAME[idx]);
     }
+    printf("\nOptions :\n");
+    printf("  -cpu                   Exact statistics on CPU at native resolution (default)\n");
+    printf("  -gpu                   Approximate statistics on GPU over a 1024x1024 resample\n");
+    printf("  -threads <n>           CPU worker threads, 0 = all cores (default)\n");
+    printf("  -ref <file>            Also compare each eye against this source file (CPU)\n");
+    printf("  -incremental           Reuse tiles unchanged since the previous frame (CPU)\n");
+    printf("  -frames <s>[:<n>]      Process <n> frames from frame <s>, default all\n");
+    printf("  -workers <n>           Split the frames into <n> shards processed concurrently (CPU)\n");
+    printf("  -dump <dir>            Write compressed intermediate planes into <dir>\n");
+    printf("  -dumpevery <n>         Dump one frame in every <n>, default 1\n");
+    printf("  -metrics <file>        Keep Prometheus text metrics up to date in <file>\n");
+    printf("  -metricsinterval <ms>  Rewrite the metrics file every <ms>, default %u\n", METRICS_DEFAULT_INTERVAL_MS);
     printf("******************************************************\n");
 }
 
 int wmain(int argc, wchar_t *argv[], wchar_t *envp[])
 {
-    if (argc != 5)
+    if (argc < 3)
     {
         printf("Invalid number of parameters!\n");
         ShowHelp();
@@ -747,14 +1103,152 @@ int wmain(int argc, wchar_t *argv[], wchar_t *envp[])
         ShowHelp();
         return -1;
     }
-    INT width = _wtoi(argv[2]);
-    INT height = _wtoi(argv[3]);
-    if ((width < 0) || (height < 0))
+
+    SSIM_OPTIONS options = { 0 };
+    options.pFileName = argv[1];
+    options.useCpu = TRUE;
+    options.workerCount = 1;
+    INT argIdx = 0;
+    if (IsY4mFile(argv[1]))
+    {
+        // Size and format come from the stream header
+        options.sType = (STEREO_TYPE)_wtoi(argv[2]);
+        argIdx = 3;
+    }
+    else
+    {
+        if (argc < 5)
+        {
+            printf("Invalid number of parameters!\n");
+            ShowHelp();
+            return -1;
+        }
+        INT width = _wtoi(argv[2]);
+        INT height = _wtoi(argv[3]);
+        if ((width <= 0) || (height <= 0))
+        {
+            printf("Width and height must be positive!\n");
+            return -1;
+        }
+        options.width = (UINT32)width;
+        options.height = (UINT32)height;
+        options.sType = (STEREO_TYPE)_wtoi(argv[4]);
+        argIdx = 5;
+    }
+    if ((options.sType < STEREO_TYPE_2D) || (options.sType >= STEREO_TYPE_COUNT))
     {
-        printf("Width and height must be positive!\n");
+        printf("Invalid stereo type!\n");
+        ShowHelp();
+        return -1;
+    }
+
+    PWCHAR pDumpDir = NULL;
+    UINT32 dumpEvery = 1;
+    PWCHAR pMetricsFile = NULL;
+    UINT32 metricsIntervalMs = METRICS_DEFAULT_INTERVAL_MS;
+    BOOL isThreadCountSet = FALSE;
+    for (; argIdx < argc; argIdx++)
+    {
+        if (_wcsicmp(argv[argIdx], L"-cpu") == 0)
+        {
+            options.useCpu = TRUE;
+        }
+        else if (_wcsicmp(argv[argIdx], L"-gpu") == 0)
+        {
+            options.useCpu = FALSE;
+        }
+        else if ((_wcsicmp(argv[argIdx], L"-ref") == 0) && (argIdx + 1 < argc))
+        {
+            options.pRefFileName = argv[++argIdx];
+        }
+        else if (_wcsicmp(argv[argIdx], L"-incremental") == 0)
+        {
+            options.isIncremental = TRUE;
+        }
+        else if ((_wcsicmp(argv[argIdx], L"-threads") == 0) && (argIdx + 1 < argc))
+        {
+            options.threadCount = (UINT32)_wtoi(argv[++argIdx]);
+            isThreadCountSet = TRUE;
+        }
+        else if ((_wcsicmp(argv[argIdx], L"-frames") == 0) && (argIdx + 1 < argc))
+        {
+            if (swscanf_s(argv[++argIdx], L"%llu:%llu", &options.frameStart, &options.frameCount) < 1)
+            {
+                printf("Invalid frame range: %ls\n", argv[argIdx]);
+                return -1;
+            }
+        }
+        else if ((_wcsicmp(argv[argIdx], L"-workers") == 0) && (argIdx + 1 < argc))
+        {
+            options.workerCount = (UINT32)_wtoi(argv[++argIdx]);
+        }
+        else if ((_wcsicmp(argv[argIdx], L"-dump") == 0) && (argIdx + 1 < argc))
+        {
+            pDumpDir = argv[++argIdx];
+        }
+        else if ((_wcsicmp(argv[argIdx], L"-dumpevery") == 0) && (argIdx + 1 < argc))
+        {
+            dumpEvery = (UINT32)_wtoi(argv[++argIdx]);
+        }
+        else if ((_wcsicmp(argv[argIdx], L"-metrics") == 0) && (argIdx + 1 < argc))
+        {
+            pMetricsFile = argv[++argIdx];
+        }
+        else if ((_wcsicmp(argv[argIdx], L"-metricsinterval") == 0) && (argIdx + 1 < argc))
+        {
+            INT intervalMs = _wtoi(argv[++argIdx]);
+            if (intervalMs <= 0)
+            {
+                printf("Metrics interval must be a positive number of milliseconds: %ls\n", argv[argIdx]);
+                return -1;
+            }
+            metricsIntervalMs = (UINT32)intervalMs;
+        }
+        else
+        {
+            printf("Unknown option: %ls\n", argv[argIdx]);
+            ShowHelp();
+            return -1;
+        }
+    }
+
+    if (options.pRefFileName && !PathFileExists(options.pRefFileName))
+    {
+        printf("Reference file doesn't exists!\n");
+        return -1;
+    }
+    if (options.pRefFileName && !options.useCpu)
+    {
+        printf("Full-reference mode is not available with -gpu!\n");
+        return -1;
+    }
+    if (options.isIncremental && !options.useCpu)
+    {
+        printf("Incremental mode is not available with -gpu!\n");
+        return -1;
+    }
+    if ((options.workerCount > 1) && !options.useCpu)
+    {
+        printf("Frame workers are not available with -gpu!\n");
+        return -1;
+    }
+    if (isThreadCountSet && !options.useCpu)
+    {
+        printf("Thread count is not available with -gpu!\n");
+        return -1;
+    }
+
+    if (pDumpDir && FAILED(DebugDumpStart(pDumpDir, dumpEvery)))
+    {
+        printf("Cannot start debug dump into %ls!\n", pDumpDir);
+        return -1;
+    }
+    if (pMetricsFile && FAILED(MetricsStart(pMetricsFile, metricsIntervalMs)))
+    {
+        printf("Cannot write metrics to %ls!\n", pMetricsFile);
+        DebugDumpStop();
         return -1;
     }
-    STEREO_TYPE sType = (STEREO_TYPE)_wtoi(argv[4]);
 
     LARGE_INTEGER qpfFreq;
     double qpfPeroid;
@@ -766,22 +1260,91 @@ int wmain(int argc, wchar_t *argv[], wchar_t *envp[])
     LARGE_INTEGER measureEnd = { 0 };
     LARGE_INTEGER ElapsedMicroseconds = { 0 };
 
-    BOOL highConfidenceLevel = FALSE;
-    double ssim = 0.0f;
+    std::vector<FRAME_RESULT> results;
+    HRESULT hr = S_OK;
 
     QueryPerformanceCounter(&measureStart);
-    ValidateStereoFormat(argv[1], (UINT)width, (UINT)height, sType, highConfidenceLevel, ssim);
+    hr = ValidateStereoFormat(options, results);
     QueryPerformanceCounter(&measureEnd);
+    DebugDumpStop();
+    MetricsStop();
     ElapsedMicroseconds.QuadPart = measureEnd.QuadPart - measureStart.QuadPart;
     ElapsedMicroseconds.QuadPart = (LONGLONG)(ElapsedMicroseconds.QuadPart * qpfPeroid);
+
+    // All frame should has SSIM no less than 0.8, given specificy stereo type
+    BOOL highConfidenceLevel = SUCCEEDED(hr) && !results.empty();
+    double ssimSum = 0.0;
+    double ssimMin = 1.0;
+    UINT64 ssimMinFrame = options.frameStart;
+    UINT64 failedCount = 0;
+    UINT64 tilesReused = 0;
+    UINT64 tilesComputed = 0;
+    double refSsimSum[STEREO_EYE_COUNT] = { 0.0 };
+    double refSsimCombinedSum = 0.0;
     printf("******************************************************\n");
     printf("Result: \n");
-    printf("Selected stereo mode: %s\n", STEREO_TYPE_NAME[sType]);
-    printf("SSIM: %f\n", ssim);
+    printf("Selected stereo mode: %s\n", STEREO_TYPE_NAME[options.sType]);
+    printf("Engine: %s\n", options.useCpu ? "CPU" : "GPU");
+    for (SIZE_T idx = 0; idx < results.size(); idx++)
+    {
+        UINT64 frameIdx = options.frameStart + idx;
+        BOOL isFramePass = SUCCEEDED(results[idx].hr) && (results[idx].ssim >= SSIM_PASS_THRESHOLD);
+        if (results.size() > 1)
+        {
+            if (SUCCEEDED(results[idx].hr) && options.pRefFileName)
+            {
+                printf("Frame %llu: SSIM " SSIM_FORMAT " %s, reference SSIM " SSIM_FORMAT " (left " SSIM_FORMAT ", right " SSIM_FORMAT ")\n", frameIdx, results[idx].ssim, isFramePass ? "PASS" : "FAIL",
+                    results[idx].refSsimCombined, results[idx].refSsim[STEREO_EYE_LEFT], results[idx].refSsim[STEREO_EYE_RIGHT]);
+            }
+            else if (SUCCEEDED(results[idx].hr))
+            {
+                printf("Frame %llu: SSIM " SSIM_FORMAT " %s\n", frameIdx, results[idx].ssim, isFramePass ? "PASS" : "FAIL");
+            }
+            else
+            {
+                printf("Frame %llu: error 0x%08lx\n", frameIdx, results[idx].hr);
+            }
+        }
+        ssimSum += results[idx].ssim;
+        tilesReused += results[idx].tilesReused;
+        tilesComputed += results[idx].tilesComputed;
+        refSsimSum[STEREO_EYE_LEFT] += results[idx].refSsim[STEREO_EYE_LEFT];
+        refSsimSum[STEREO_EYE_RIGHT] += results[idx].refSsim[STEREO_EYE_RIGHT];
+        refSsimCombinedSum += results[idx].refSsimCombined;
+        if ((idx == 0) || (results[idx].ssim < ssimMin))
+        {
+            ssimMin = results[idx].ssim;
+            ssimMinFrame = frameIdx;
+        }
+        if (!isFramePass)
+        {
+            failedCount++;
+            highConfidenceLevel = FALSE;
+        }
+    }
+    if (FAILED(hr))
+    {
+        printf("Error: 0x%08lx\n", hr);
+    }
+    printf("SSIM: " SSIM_FORMAT "\n", results.empty() ? 0.0 : ssimSum / results.size());
+    if (results.size() > 1)
+    {
+        printf("Min SSIM: " SSIM_FORMAT " (frame %llu)\n", ssimMin, ssimMinFrame);
+        printf("Failed frames: %llu of %llu\n", failedCount, (UINT64)results.size());
+    }
+    if (options.pRefFileName && !results.empty())
+    {
+        // Encode quality is reported only, the verdict stays on stereo format
+        printf("Reference SSIM: " SSIM_FORMAT " (left " SSIM_FORMAT ", right " SSIM_FORMAT ")\n", refSsimCombinedSum / results.size(),
+            refSsimSum[STEREO_EYE_LEFT] / results.size(), refSsimSum[STEREO_EYE_RIGHT] / results.size());
+    }
+    if (options.isIncremental && (tilesReused + tilesComputed > 0))
+    {
+        printf("Reused tiles: %llu of %llu\n", tilesReused, tilesReused + tilesComputed);
+    }
     printf("Time elapsed: %lluus\n", ElapsedMicroseconds.QuadPart);
     printf("%s\n", highConfidenceLevel ? VALIDATE_PASS_MSG : VALIDATE_FAIL_MSG);
     printf("******************************************************\n");
 
     return 0;
 }
-